@@ -13,6 +13,10 @@
 	OPTIONAL DEFINES:
 		HT_MULTIPLE_VALUES: indicates that one key might map to multiple values which you may iterate over. HT_VALUE must be defined
 		HT_MULTIPLE_VALUES_ORDERED: tells the hashtable to keep the insertion order of the values mapping to one key. HT_MULTIPLE_VALUES is implicit.
+		HT_INLINE_VALUES: for HT_MULTIPLE_VALUES, a key keeps at most this many values in the table itself, the rest go in one array for that key.
+			Keys with thousands of values then don't make long probe chains and remove frees all of them at once. The iterators go over both.
+			length only counts the values in the table, num_spilled the rest. Not supported with HT_SOA or HT_SNAPSHOT.
+			insert_bulk spills the same way insert does, so HT_MULTIPLE_VALUES_ORDERED still holds.
 		HT_VALUE: the type of the value you want the key to map to. If not defined this is a hashset
 		HT_EQUAL(a,b): the equality function for the keys. If not defined this this defaults to HT_EQUAL(a,b) a==b
 		HT_FAST_KEY_COMP 0/1: indicates that HT_EQUAL it is faster to run HT_EQUAL(a,b) instead of hash_a == hash_b && HT_EQUAL(a,b). defaults to 0 if HT_EQUAL is defined, 1 otherwise
@@ -21,14 +25,73 @@
 		HT_ALLOCATOR: the type of a custom allocator. You must define ALLOC and FREE if this is defined!
 		HT_ALLOC(num_bytes)    : the function to dynamically alloc memory: defaults to HT_ALLOC(num_bytes) malloc(num_bytes)
 		HT_FREE (ptr,num_bytes): the function to dynamically deallocate memory: defaults to HT_FREE (ptr,num_bytes) free(ptr)
+		HT_BATCH_SIZE: how many keys lookup_batch/insert_batch have in flight at once, defaults to 16.
+		HT_INCREMENTAL_RESIZE: instead of rehashing everything at once when growing, the old slots are kept around and HT_MIGRATE_STEP (default 16) of them
+			are moved over on every insert/lookup/remove until they're all moved. Lookups check both while that's going on. Not supported with HT_MULTIPLE_VALUES.
+		HT_CONCURRENT_SHARDS: makes HT_NAME a thread safe table made up of this many (power of two) independent tables, each behind its own lock.
+			the shard is picked from the high bits of the hash and every shard grows and shrinks on its own. Only insert/lookup/remove/count, not for HT_MULTIPLE_VALUES.
+		HT_OPTIMISTIC_READERS: the number of threads that may call lookup_optimistic(reader_id, ...) while one writer thread uses the rest of the table.
+			readers don't take locks or do any atomic read-modify-write, they retry if a write happened while they were probing (a seqlock).
+			freed slot arrays are only given back once no reader can still be looking at them (epoch based). Every reader needs its own id {0 .. HT_OPTIMISTIC_READERS-1}.
+			Writers must be serialized by you. Keys and values are read while they might be written, so HT_EQUAL must not follow pointers.
+			Not supported with HT_SOA, HT_SIMD_PROBE, HT_INCREMENTAL_RESIZE, HT_CONCURRENT_SHARDS or HT_MULTIPLE_VALUES.
+		HT_SNAPSHOT: adds save(fd) and map_readonly(path) (posix only). save writes a small header and then the slots as they are in memory,
+			map_readonly mmaps such a file and points the table at it, so it can be queried without reinserting anything.
+			Keys and values must be plain data (no pointers) for that to make sense. A mapped table is read only, writing to it crashes,
+			call resizeTo(capacity) first if you want a writable copy. The header records the hash function as HT_HASH_ID, which defaults
+			to a hash of the text of HT_HASH(key), so define it yourself if the same text can mean different hash functions.
+		HT_SOA: stores the hashes, keys and values in three separate arrays instead of an array of buckets. Probing only touches the hashes
+			until they match, so this is a win when keys/values are large. Buckets are still used to pass entries in and out.
+		HT_COMPACT: the slots don't keep the hash, only the probe distance (one byte) and 7 bits of the hash as a fingerprint, packed right
+			after the key and value. A u32/u32 slot is 10 bytes instead of 12, so more of them fit in a cache line. The full hash is only
+			needed when entries move to a new slots array (resizing), it's recomputed from the key then, so HT_HASH should be cheap.
+			key_at/value_at return copies (the fields aren't aligned), insert again to change a value. A key more than 255 slots from
+			its home makes the table double right away, so a really bad hash function will eat all your memory instead of getting slow.
+			bucket.hash is still the real hash when you get a bucket out of the table. Not supported with HT_SOA, HT_SIMD_PROBE,
+			HT_MULTIPLE_VALUES, HT_STRING_KEYS, HT_INCREMENTAL_RESIZE, HT_OPTIMISTIC_READERS or HT_SNAPSHOT.
+		HT_SIMD_PROBE: keeps one metadata byte per slot (4 bits of hash and 4 bits of probe distance) next to the buckets and probes 16 (SSE2) or 32 (AVX2) slots per compare.
+			the buckets themselves are only touched on a fingerprint hit, which mostly helps unsuccessful lookups and big keys/values. Costs one extra byte per slot.
+		HT_SEED: every table gets its own seed which is mixed into HT_HASH(key), so two tables with the same hashfunction don't have the same order
+			(see the quadratic gotcha below). The seed is picked from the address of the table when it's constructed, call set_seed(seed) on an empty
+			table if you need the same layout every run. Costs a multiply and a shift per hash.
+		HT_STATS: counts what the table is doing so you can see what a load factor costs, get_stats() returns them. Probe length histograms
+			for lookups that hit and that missed, robin hood swaps per insert, how many entries remove_at shifted back, the number of resizes and
+			the time spent in them. get_stats() walks the slots to fill in how far entries are from home, so don't call it in a hot loop.
+			Without HT_STATS none of it exists. lookup_optimistic is never counted.
+		HT_LARGE: for tables past 2^31 slots. capacity and min_size are 64 bit and so is the stored hash, so HT_HASH should
+			return 64 good bits (dh_ht_hash_u64, dh_ht_hash_bytes). Costs 4 more bytes per slot. Unless HT_ALLOCATOR is defined, the slots are mmapped
+			(VirtualAlloc on windows) on huge pages if there are any reserved, otherwise with madvise(MADV_HUGEPAGE), which cuts down on TLB misses.
+		HT_STRING_KEYS: the keys are strings, HT_KEY is DH_HT_Str (don't define it) which you make with dh_ht_str(data, length) for every
+			insert/lookup/remove. HT_HASH and HT_EQUAL are done for you (define them if you want something else). Keys up to 12 bytes are stored in the bucket, longer ones keep 4
+			bytes there and the rest is copied into an arena the table owns, so there's no malloc per key and most mismatches are caught
+			without following a pointer. The arena is compacted whenever the table resizes (or it fills up). key_chars(&bucket.key) gives
+			you the bytes of a key you got out of the table, it's only good until the next insert. Those keys don't mean anything to other
+			tables, put them through dh_ht_str(key_chars(..), dh_ht_str_length(..)) first. Not supported with HT_MULTIPLE_VALUES,
+			HT_INCREMENTAL_RESIZE, HT_OPTIMISTIC_READERS or HT_SNAPSHOT.
+		HT_PARALLEL_RESIZE: the number of threads that split up the work when the table doubles (you'll need to link with pthreads).
+			every thread moves its own piece of the old slots, only tables with at least HT_PARALLEL_RESIZE_MIN (default 65536) slots per thread
+			use more than one. Smaller tables and shrinking/resizeTo stay on the calling thread. The table is still not thread safe itself.
+		HT_PARALLEL_ITERATION: adds parallel_for_each(fn, num_threads) which calls fn(const Bucket &) for every entry from that many threads
+			(you'll need to link with pthreads). It's built on range(part, num_parts), which is always there: an Iterator over just one
+			piece of the slots so you can split a scan up yourself. Nothing may change the table while any of them is running.
+		HT_LOOKUP_KEY: a second key type lookup_hashed(hash, key, ...) accepts, say a (pointer, length) view for a table of owned strings,
+			so you don't have to build an HT_KEY just to look something up. HT_LOOKUP_EQUAL(lookup_key, key) must be defined with it, and
+			the hash you pass is finish_hash(x) where x is what HT_HASH gives for the equal HT_KEY, the table can't check that for you.
+
+	HASH FUNCTIONS:
+		there are some you can use for HT_HASH, they're decent and fast:
+		dh_ht_hash_u32(x), dh_ht_hash_u64(x) : multiply-xorshift mixers for integer keys (and pointers) the low bits depend on all the bits
+		dh_ht_hash_bytes(data, num_bytes, seed) : wyhash style hash for strings and other byte blobs. Works on 48 bytes at a time once keys get long.
 	GOTCHAS:
 		We're quadratic if you insert from one hashtable into another in order without reserving. I don't feel like this is a bug but you should certianly be aware of it!
 			A detailed blogpost about the same problem for the rust hashtable can be found at: https://accidentallyquadratic.tumblr.com/post/153545455987/rust-hash-iteration-reinsertion
 			Usually the solution here is to reserve in advance or to use different hashfunctions for the different tables or same but xor with random number (during compiletime)
+			or use insert_bulk, which doesn't care about the order of its input. Or define HT_SEED.
 
 		when iterating over the hashtable (or a key in the hashtable when having mutiple values) 
 			you *MUST NOT* call remove twice. This will silently fuck shit up. 
 			you must not do anything to the underlying hashtable(insert remove change a key etc.) this will silently fuck shit up. (iterator.remove() is fine of course)
+			if you're removing a lot of them use retain(keep)/erase_if(remove) instead, that's one pass over the table and no shifting per remove.
 
 		when calling remove_at(index) you *MUST* make sure that the index holds a entry. Failing to do that will silently fuck shit up.
 
@@ -45,11 +108,40 @@
 #define HT_MULTIPLE_VALUES
 #endif
 
+#ifdef HT_INLINE_VALUES
+#if !defined(HT_MULTIPLE_VALUES) || defined(HT_SOA) || defined(HT_SNAPSHOT)
+#error HT_INLINE_VALUES needs HT_MULTIPLE_VALUES and does not support HT_SOA or HT_SNAPSHOT
+#define HT_ERROR
+#endif
+#endif
+
+#ifdef HT_COMPACT
+#if defined(HT_SOA) || defined(HT_SIMD_PROBE) || defined(HT_MULTIPLE_VALUES) || defined(HT_STRING_KEYS) || defined(HT_INCREMENTAL_RESIZE) \
+	|| defined(HT_OPTIMISTIC_READERS) || defined(HT_SNAPSHOT)
+#error HT_COMPACT does not support HT_SOA, HT_SIMD_PROBE, HT_MULTIPLE_VALUES, HT_STRING_KEYS, HT_INCREMENTAL_RESIZE, HT_OPTIMISTIC_READERS or HT_SNAPSHOT
+#define HT_ERROR
+#endif
+#endif
+
 #ifndef HT_NAME
 #error HT_NAME macro must be defined
 #define HT_ERROR
 #endif
 
+#ifdef HT_STRING_KEYS
+#if defined(HT_KEY) || defined(HT_MULTIPLE_VALUES) || defined(HT_INCREMENTAL_RESIZE) || defined(HT_OPTIMISTIC_READERS) || defined(HT_SNAPSHOT)
+#error HT_STRING_KEYS brings its own HT_KEY and does not support HT_MULTIPLE_VALUES, HT_INCREMENTAL_RESIZE, HT_OPTIMISTIC_READERS or HT_SNAPSHOT
+#define HT_ERROR
+#endif
+#define HT_KEY DH_HT_Str
+#ifndef HT_HASH
+#define HT_HASH(key) str_hash(key)
+#endif
+#ifndef HT_EQUAL
+#define HT_EQUAL(a,b) str_equal(a, b)
+#endif
+#endif
+
 #ifndef HT_KEY
 #error HT_KEY macro must be defined
 #define HT_ERROR
@@ -60,6 +152,11 @@
 #define HT_ERROR
 #endif
 
+#if defined(HT_LOOKUP_KEY) && !defined(HT_LOOKUP_EQUAL)
+#error if HT_LOOKUP_KEY is defined so must HT_LOOKUP_EQUAL
+#define HT_ERROR
+#endif
+
 
 
 #ifndef HT_FAST_KEY_CMP
@@ -80,8 +177,100 @@
 
 #ifdef HT_SHRINK_FACTOR
 static_assert(HT_GROW_FACTOR / 2 > HT_SHRINK_FACTOR, "HT_SHRINK_FACTOR must be smaller than HT_GROW_FACTOR/2 otherwise we get will bounce between them!");
+#endif
+
+#ifndef HT_BATCH_SIZE
+#define HT_BATCH_SIZE 16
+#endif
+
+// with HT_CONCURRENT_SHARDS the table itself is generated as HT_NAME_Shard and HT_NAME is the sharded front-end at the bottom
+#ifdef HT_CONCURRENT_SHARDS
+#define HT_CONCAT2(a, b) a##b
+#define HT_CONCAT(a, b) HT_CONCAT2(a, b)
+#define HT_TABLE HT_CONCAT(HT_NAME, _Shard)
+#ifdef HT_MULTIPLE_VALUES
+#error HT_CONCURRENT_SHARDS does not support HT_MULTIPLE_VALUES
+#define HT_ERROR
+#endif
+#ifdef HT_ALLOCATOR
+#error HT_CONCURRENT_SHARDS does not support HT_ALLOCATOR
+#define HT_ERROR
+#endif
+static_assert(HT_CONCURRENT_SHARDS > 0 && !(HT_CONCURRENT_SHARDS & (HT_CONCURRENT_SHARDS - 1)), "HT_CONCURRENT_SHARDS must be a power of two");
+#include <mutex>
+#include <new>
+#else
+#define HT_TABLE HT_NAME
+#endif
+
+#ifdef _WIN32
+#define HT_ALIGN_CACHE_LINE __declspec(align(64))
+#else
+#define HT_ALIGN_CACHE_LINE __attribute__ ((aligned (64)))
+#endif
+
+#ifdef HT_OPTIMISTIC_READERS
+#if defined(HT_SOA) || defined(HT_SIMD_PROBE) || defined(HT_INCREMENTAL_RESIZE) || defined(HT_CONCURRENT_SHARDS) || defined(HT_MULTIPLE_VALUES)
+#error HT_OPTIMISTIC_READERS does not support HT_SOA, HT_SIMD_PROBE, HT_INCREMENTAL_RESIZE, HT_CONCURRENT_SHARDS or HT_MULTIPLE_VALUES
+#define HT_ERROR
+#endif
+#include <atomic>
+#define HT_WRITE_BEGIN write_begin();
+#define HT_WRITE_END write_end();
+#else
+#define HT_WRITE_BEGIN
+#define HT_WRITE_END
+#endif
+
+#ifdef HT_SNAPSHOT
+#ifdef _WIN32
+#error HT_SNAPSHOT is only implemented for posix
+#define HT_ERROR
+#endif
+#ifdef HT_OPTIMISTIC_READERS
+#error HT_SNAPSHOT does not support HT_OPTIMISTIC_READERS
+#define HT_ERROR
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HT_STR2(x) #x
+#define HT_STR(x) HT_STR2(x)
+#ifndef HT_HASH_ID
+#define HT_HASH_ID dh_ht_fnv1a(HT_STR(HT_HASH(key)))
+#endif
+#define HT_SNAPSHOT_DATA_OFFSET 4096
+#define HT_SNAPSHOT_MAGIC 0x50414E5354484844ull // "DHHTSNAP"
+#endif
+
+#if defined(HT_PARALLEL_RESIZE) || defined(HT_PARALLEL_ITERATION)
+#include <thread>
+#endif
+#ifdef HT_PARALLEL_RESIZE
+#ifndef HT_PARALLEL_RESIZE_MIN
+#define HT_PARALLEL_RESIZE_MIN (1 << 16)
+#endif
+#endif
+
+#ifdef HT_STATS
+#include <chrono>
+#define HT_STAT(x) x
+// histograms count lengths 0 to 30 exactly, the last entry is everything 31 and up
+#define HT_STATS_HISTOGRAM 32
+#else
+#define HT_STAT(x)
+#endif
+
+#ifdef HT_INCREMENTAL_RESIZE
+#ifdef HT_MULTIPLE_VALUES
+#error HT_INCREMENTAL_RESIZE does not support HT_MULTIPLE_VALUES
 #define HT_ERROR
 #endif
+#ifndef HT_MIGRATE_STEP
+#define HT_MIGRATE_STEP 16
+#endif
+#endif
 
 #ifdef HT_ALLOCATOR
 #ifndef HT_ALLOC
@@ -92,46 +281,360 @@ static_assert(HT_GROW_FACTOR / 2 > HT_SHRINK_FACTOR, "HT_SHRINK_FACTOR must be s
 #error if HT_ALLOCATOR is defined so must HT_FREE
 #define HT_ERROR
 #endif
+#elif defined(HT_LARGE)
+#define HT_ALLOC(num_bytes)	  dh_ht_large_alloc(num_bytes)
+#define HT_FREE(ptr, num_bytes) dh_ht_large_free(ptr, num_bytes)
+// that memory comes zeroed from the os, so the slots don't have to be cleared (which would touch every page up front)
+#define HT_ALLOC_ZEROED
 #else
 #define HT_ALLOC(num_bytes)	  malloc(num_bytes)
 #define HT_FREE(ptr, num_bytes) free(ptr)
 #endif
 
-#define HT_SWAP(type, a, b)do{type tmp = a; a = b; b = tmp;}while(0);
+#if defined(HT_LARGE) && !defined(DH_HASHTABLE_LARGE_ALLOC)
+#define DH_HASHTABLE_LARGE_ALLOC
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#define DH_HT_HUGE_PAGE ((size_t)2 << 20)
+
+// anything from a huge page up is mapped, preferably onto reserved huge pages (MAP_HUGETLB, those only work for whole pages
+// and only if the admin set vm.nr_hugepages) otherwise onto normal ones with a hint to use transparent huge pages.
+// smaller blocks use calloc, the size alone decides which so free can tell them apart.
+static inline void *dh_ht_large_alloc(size_t num_bytes) {
+	if (num_bytes < DH_HT_HUGE_PAGE) return calloc(num_bytes, 1);
+#ifdef _WIN32
+	// large pages need a privilege most users don't have
+	return VirtualAlloc(0, num_bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void *ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (num_bytes % DH_HT_HUGE_PAGE == 0) ptr = mmap(0, num_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (ptr == MAP_FAILED) {
+		ptr = mmap(0, num_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+		madvise(ptr, num_bytes, MADV_HUGEPAGE);
+#endif
+	}
+	return ptr;
+#endif
+}
+
+static inline void dh_ht_large_free(void *ptr, size_t num_bytes) {
+	if (!ptr) return;
+	if (num_bytes < DH_HT_HUGE_PAGE) {
+		free(ptr);
+		return;
+	}
+#ifdef _WIN32
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, num_bytes);
+#endif
+}
+#endif
+
+#ifdef HT_SIMD_PROBE
+#include <immintrin.h>
+#ifdef __AVX2__
+#define HT_GROUP 32
+#else
+#define HT_GROUP 16
+#endif
+#endif
+
+#ifndef DH_HASHTABLE_COMMON
+#define DH_HASHTABLE_COMMON
+#ifdef _MSC_VER
+#include <intrin.h>
+#define DH_HT_PREFETCH(ptr) _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
+#else
+#define DH_HT_PREFETCH(ptr) __builtin_prefetch(ptr)
+#endif
+
+static inline uint32_t dh_ht_ctz(uint32_t x) {
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, x);
+	return idx;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+static inline uint64_t dh_ht_fnv1a(const char *str) {
+	uint64_t hash = 14695981039346656037ull;
+	for (; *str; ++str) hash = (hash ^ (uint8_t)*str) * 1099511628211ull;
+	return hash;
+}
+
+// not cryptographic, just catches truncated or corrupted files. 8 bytes at a time so it runs at memory speed.
+static inline uint64_t dh_ht_checksum(const void *data, size_t num_bytes) {
+	const uint8_t *at = (const uint8_t *)data;
+	uint64_t hash = 0x9E3779B97F4A7C15ull ^ num_bytes;
+	for (; num_bytes >= 8; num_bytes -= 8, at += 8) {
+		uint64_t word;
+		memcpy(&word, at, 8);
+		hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 32;
+	}
+	for (; num_bytes; --num_bytes, ++at) hash = (hash ^ *at) * 0x100000001B3ull;
+	return hash;
+}
+
+static inline uint64_t dh_ht_min(uint64_t a, uint64_t b) { return a < b ? a : b; }
+static inline uint64_t dh_ht_max(uint64_t a, uint64_t b) { return a > b ? a : b; }
+
+static inline uint32_t dh_ht_hash_u32(uint32_t x) {
+	x ^= x >> 16; x *= 0x21F0AAADu;
+	x ^= x >> 15; x *= 0x735A2D97u;
+	x ^= x >> 15;
+	return x;
+}
+
+static inline uint64_t dh_ht_hash_u64(uint64_t x) {
+	x ^= x >> 32; x *= 0xD6E8FEB86659FD93ull;
+	x ^= x >> 32; x *= 0xD6E8FEB86659FD93ull;
+	x ^= x >> 32;
+	return x;
+}
+
+// 64x64->128 multiply
+static inline void dh_ht_mul128(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi) {
+#if defined(__SIZEOF_INT128__)
+	__uint128_t r = (__uint128_t)a * b;
+	*lo = (uint64_t)r;
+	*hi = (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	*lo = _umul128(a, b, hi);
+#else
+	uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl;
+	*lo = t + (rm1 << 32);
+	c += *lo < t;
+	*hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t dh_ht_mum(uint64_t a, uint64_t b) {
+	uint64_t lo, hi;
+	dh_ht_mul128(a, b, &lo, &hi);
+	return lo ^ hi;
+}
+
+static inline uint64_t dh_ht_read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t dh_ht_read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+// wyhash: three independent multiply lanes for long keys, short keys are read with (overlapping) loads instead of byte loops.
+// little endian only, the hashes differ between endians (they're still fine hashes, just don't store them)
+static inline uint64_t dh_ht_hash_bytes(const void *data, size_t num_bytes, uint64_t seed) {
+	const uint64_t s0 = 0x2D358DCCAA6C78A5ull, s1 = 0x8BB84B93962EACC9ull, s2 = 0x4B33A62ED433D4A3ull, s3 = 0x4D5A2DA51DE1AA47ull;
+	const uint8_t *p = (const uint8_t *)data;
+	seed ^= dh_ht_mum(seed ^ s0, s1);
+	uint64_t a, b;
+	if (num_bytes <= 16) {
+		if (num_bytes >= 4) {
+			size_t mid = (num_bytes >> 3) << 2;
+			a = (dh_ht_read32(p) << 32) | dh_ht_read32(p + mid);
+			b = (dh_ht_read32(p + num_bytes - 4) << 32) | dh_ht_read32(p + num_bytes - 4 - mid);
+		} else if (num_bytes > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[num_bytes >> 1] << 8) | p[num_bytes - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t left = num_bytes;
+		if (left > 48) {
+			uint64_t seed1 = seed, seed2 = seed;
+			do {
+				seed = dh_ht_mum(dh_ht_read64(p) ^ s1, dh_ht_read64(p + 8) ^ seed);
+				seed1 = dh_ht_mum(dh_ht_read64(p + 16) ^ s2, dh_ht_read64(p + 24) ^ seed1);
+				seed2 = dh_ht_mum(dh_ht_read64(p + 32) ^ s3, dh_ht_read64(p + 40) ^ seed2);
+				p += 48;
+				left -= 48;
+			} while (left > 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (left > 16) {
+			seed = dh_ht_mum(dh_ht_read64(p) ^ s1, dh_ht_read64(p + 8) ^ seed);
+			p += 16;
+			left -= 16;
+		}
+		a = dh_ht_read64(p + left - 16);
+		b = dh_ht_read64(p + left - 8);
+	}
+	dh_ht_mul128(a ^ s1, b ^ seed, &a, &b);
+	return dh_ht_mum(a ^ s0 ^ num_bytes, b ^ s1);
+}
+#endif
+
+#if defined(HT_STRING_KEYS) && !defined(DH_HASHTABLE_STR)
+#define DH_HASHTABLE_STR
+#define DH_HT_STR_INLINE 12
+#define DH_HT_STR_IN_ARENA 0x80000000u
+
+// the key of HT_STRING_KEYS tables. Up to 12 bytes are kept right here (zero padded), longer keys keep their first 4 bytes
+// here and the rest of it is either wherever you pointed dh_ht_str at or, once it's in a table, in that table's arena.
+// it's two words so it's passed around in registers, the first one is the length and the prefix so most mismatches are one compare.
+struct DH_HT_Str {
+	uint32_t length; // the top bit is set when offset is used instead of ptr
+	char prefix[4];
+	union {
+		char tail[8];
+		const char *ptr;
+		uint64_t offset;
+	};
+};
+
+// the first n (up to 8) bytes at p, zero padded, without reading past p + n
+static inline uint64_t dh_ht_read_partial(const uint8_t *p, size_t n) {
+	if (n >= 4) return dh_ht_read32(p) | (dh_ht_read32(p + n - 4) << (8 * (n - 4)));
+	if (n > 0) return p[0] | ((uint64_t)p[n >> 1] << (8 * (n >> 1))) | ((uint64_t)p[n - 1] << (8 * (n - 1)));
+	return 0;
+}
+
+// doesn't copy long keys, data has to stay around until the insert/lookup it's used for is done.
+// the key is put together in registers and written a word at a time, so loading it a word at a time right after doesn't stall
+static inline DH_HT_Str dh_ht_str(const char *data, uint32_t length) {
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t words[2];
+	if (length <= DH_HT_STR_INLINE) {
+		words[0] = length | (dh_ht_read_partial(p, length < 4 ? length : 4) << 32);
+		words[1] = length > 4 ? dh_ht_read_partial(p + 4, length - 4) : 0;
+	} else {
+		words[0] = length | (dh_ht_read32(p) << 32);
+		words[1] = (uint64_t)(uintptr_t)data;
+	}
+	DH_HT_Str key;
+	memcpy(&key, words, sizeof(words));
+	return key;
+}
+
+static inline uint32_t dh_ht_str_length(const DH_HT_Str &key) {
+	return key.length & ~DH_HT_STR_IN_ARENA;
+}
+#endif
 
 
 #ifndef HT_ERROR
-struct HT_NAME {
+struct HT_TABLE {
+	// so const can be put on them, HT_KEY might be a pointer type (const HT_KEY * with const char * doesn't compile)
+	typedef HT_KEY Key;
+#ifdef HT_LOOKUP_KEY
+	typedef HT_LOOKUP_KEY LookupKey;
+#else
+	typedef HT_KEY LookupKey;
+#endif
+#ifdef HT_VALUE
+	typedef HT_VALUE Value;
+#endif
+#ifdef HT_LARGE
+	// past 2^32 slots the home slot needs more bits than a 32 bit hash has
+	typedef uint64_t Hash;
+	typedef uint64_t Size;
+#else
+	typedef uint32_t Hash;
+	typedef uint32_t Size;
+#endif
+
 	struct Bucket {
 		HT_KEY key;
 #ifdef HT_VALUE
 		HT_VALUE value;
 #endif
-		uint32_t hash;
+		Hash hash;
+#ifdef HT_INLINE_VALUES
+		// only set on the first bucket of a key, 1 + the index of its SpillBlock or 0 if it has none
+		uint32_t spill;
+#endif
+	};
+
+#ifdef HT_COMPACT
+#pragma pack(push, 1)
+	struct Slot {
+		HT_KEY key;
+#ifdef HT_VALUE
+		HT_VALUE value;
+#endif
+		uint8_t dist; // the probe count, 255 if it didn't fit (we double right after that)
+		uint8_t fingerprint; // the top 7 bits of the hash with the high bit set, 0 is empty
 	};
+#pragma pack(pop)
+	static const int fingerprint_shift = sizeof(Hash) * 8 - 8;
+#endif
 
 #define HT_EMPTY 0
 #ifdef HT_MULTIPLE_VALUES
 	struct ValueIterator {
 		uint64_t idx;
-		HT_NAME *ht;
+		HT_TABLE *ht;
 		HT_KEY  fst_key;
-		uint32_t fst_hash;
+		Hash fst_hash;
+#ifdef HT_INLINE_VALUES
+		// the slot with the spill handle and how far we're into the spilled values, they come after the ones in the table.
+		// without a handle first can be taken over by another key when we remove, so the handle is kept here as well
+		uint64_t first;
+		uint32_t spill;
+		uint32_t spill_pos;
+		bool inline_done;
+#endif
+		// remove doesn't shrink the table under us, if it removed anything that happens once we're through
+		bool removed;
+
+		bool finished() {
+			if (removed) {
+				ht->shrink_to_fit();
+				ht = 0; // idx means nothing after that
+			}
+			removed = false;
+			return false;
+		}
+
 		bool next(HT_VALUE *value) {
+			if (!ht) return false;
+#ifdef HT_INLINE_VALUES
+			if (inline_done) {
+				if (!spill || spill_pos >= ht->spill_blocks[spill - 1].count) return finished();
+				*value = ht->spill_blocks[spill - 1].values[spill_pos++];
+				return true;
+			}
+#endif
 			// Note if we fill the entire table this won't work. But we don't (not even with a load factor of one) so that's fine.
-			if (fst_hash == ht->buckets[idx].hash && ht->equal(fst_key, ht->buckets[idx].key)) {
-				*value = ht->buckets[idx].value;
+			if (fst_hash == ht->hash_at(idx) && ht->equal(fst_key, ht->key_at(idx))) {
+				*value = ht->value_at(idx);
 				idx = ht->mask(idx + 1);
 				return true;
 			}
-			return false;
+#ifdef HT_INLINE_VALUES
+			inline_done = true;
+			return next(value);
+#else
+			return finished();
+#endif
 		}
 
 		void remove() {
+			removed = true;
+#ifdef HT_INLINE_VALUES
+			if (inline_done) {
+				ht->remove_spilled(first, --spill_pos);
+				spill = ht->spill_at(first);
+				return;
+			}
+			idx = ht->mask(idx - 1);
+			ht->remove_inline_value(first, idx, false);
+			if (spill) spill = ht->spill_at(first);
+#else
 			idx = ht->mask(idx - 1);
-			if (ht->buckets[idx].key == 985)__debugbreak;
-			ht->remove_at(idx);
-			if (ht->buckets[idx].hash == HT_EMPTY) idx = ht->mask(idx+1);
+			ht->remove_at(idx, false);
+#endif
+			if (ht->hash_at(idx) == HT_EMPTY) idx = ht->mask(idx+1);
 		}
 
 };
@@ -148,7 +651,9 @@ struct HT_NAME {
 	}
 	inline void *_alloc_and_zero(size_t num_bytes) {
 		void *ptr = _alloc(num_bytes);
+#ifndef HT_ALLOC_ZEROED
 		memset(ptr, 0, num_bytes);
+#endif
 		return ptr;
 	}
 
@@ -156,64 +661,384 @@ struct HT_NAME {
 		HT_FREE(ptr, num_bytes);
 	}
 
+#ifdef HT_SOA
+	Hash *hashes;
+	HT_KEY *keys;
+#ifdef HT_VALUE
+	HT_VALUE *values;
+#endif
+#elif defined(HT_COMPACT)
+	Slot *slots;
+	// set when a write didn't fit in a slot's dist, whoever wrote it has to double the table before anyone looks at it
+	bool overflowed;
+#else
 	Bucket *buckets;
-	int min_size;
-	uint32_t capacity;
+#endif
+#ifdef HT_SIMD_PROBE
+	// one byte per slot: fingerprint in the high nibble, probe distance + 1 in the low nibble (0 is empty, 15 is 14 or more).
+	// the first HT_GROUP bytes are mirrored after the last slot so a group can always be loaded unaligned without wrapping.
+	uint8_t *meta;
+#endif
+	Size min_size;
+	Size capacity;
 	uint64_t length;
+#ifdef HT_SEED
+	uint64_t seed;
+#endif
+#ifdef HT_STATS
+	struct Stats {
+		uint64_t hit_probes[HT_STATS_HISTOGRAM];  // by distance from the home slot to the key
+		uint64_t miss_probes[HT_STATS_HISTOGRAM]; // by distance from the home slot to where we knew it wasn't there
+		uint64_t inserts;       // only those that took a new slot
+		uint64_t insert_swaps;
+		uint64_t removes;
+		uint64_t shift_lengths[HT_STATS_HISTOGRAM]; // entries moved back by a remove
+		uint64_t resizes;
+		double resize_seconds;
+		// of the entries in the table right now, filled in by get_stats
+		uint64_t max_displacement;
+		double avg_displacement;
+	};
+	Stats stats;
+#endif
+#ifdef HT_OPTIMISTIC_READERS
+	// odd while a write is in progress
+	std::atomic<uint64_t> version;
+	int write_depth;
+	// a reader that is probing publishes the epoch it started in, 0 when it isn't reading
+	std::atomic<uint64_t> epoch;
+	struct HT_ALIGN_CACHE_LINE Reader {
+		std::atomic<uint64_t> epoch;
+	} readers[HT_OPTIMISTIC_READERS];
+	// slot arrays that were replaced but might still be read, freed once every reader has moved past retire_epoch
+	struct Retired {
+		void *storage;
+		size_t num_bytes;
+		uint64_t retire_epoch;
+	} *retired;
+	int num_retired;
+	int max_retired;
+#endif
+#ifdef HT_INLINE_VALUES
+	// the values that didn't fit in the table. A free block has values == 0 and count is the handle of the next free one.
+	struct SpillBlock {
+		HT_VALUE *values;
+		uint32_t count;
+		uint32_t capacity;
+	} *spill_blocks;
+	uint32_t num_spill_blocks;
+	uint32_t max_spill_blocks;
+	uint32_t free_spill_block;
+	uint64_t num_spilled;
+#endif
+#ifdef HT_STRING_KEYS
+	// the bytes of the keys that don't fit in the bucket, appended as keys are inserted. Removed keys leave their bytes
+	// behind until the table resizes or the arena is full, then the live keys are copied into a new one.
+	char *arena;
+	uint64_t arena_length;
+	uint64_t arena_capacity;
+#endif
+#ifdef HT_SNAPSHOT
+	// nonzero if the slots are a mapped snapshot, the size of the whole mapping
+	size_t mapped_bytes;
+#endif
+#ifdef HT_INCREMENTAL_RESIZE
+	// while growing: the slots we're growing from, and everything in old at or above migrate_pos has been moved over (and is empty).
+	// length counts the entries in both.
+	HT_TABLE *old;
+	uint64_t migrate_pos;
+#endif
+
+	// all the per slot arrays live in one allocation, each starting on a cache line.
+	static size_t round_up(size_t bytes) {
+		return (bytes + 63) & ~(size_t)63;
+	}
+
+	static size_t storage_bytes(uint64_t capacity) {
+#ifdef HT_SOA
+		size_t bytes = round_up(capacity * sizeof(Hash)) + round_up(capacity * sizeof(HT_KEY));
+#ifdef HT_VALUE
+		bytes += round_up(capacity * sizeof(HT_VALUE));
+#endif
+#elif defined(HT_COMPACT)
+		size_t bytes = round_up(capacity * sizeof(Slot));
+#else
+		size_t bytes = round_up(capacity * sizeof(Bucket));
+#endif
+#ifdef HT_SIMD_PROBE
+		bytes += capacity + HT_GROUP;
+#endif
+		return bytes;
+	}
+
+	void set_storage(void *storage, uint64_t capacity) {
+		char *at = (char *)storage;
+		this->capacity = (Size)capacity;
+#ifdef HT_SOA
+		this->hashes = (Hash *)at; at += round_up(capacity * sizeof(Hash));
+		this->keys = (HT_KEY *)at;     at += round_up(capacity * sizeof(HT_KEY));
+#ifdef HT_VALUE
+		this->values = (HT_VALUE *)at; at += round_up(capacity * sizeof(HT_VALUE));
+#endif
+#elif defined(HT_COMPACT)
+		this->slots = (Slot *)at;      at += round_up(capacity * sizeof(Slot));
+#else
+		this->buckets = (Bucket *)at;  at += round_up(capacity * sizeof(Bucket));
+#endif
+#ifdef HT_SIMD_PROBE
+		this->meta = (uint8_t *)at;
+#endif
+	}
+
+	inline void *storage_base() {
+#ifdef HT_SOA
+		return hashes;
+#elif defined(HT_COMPACT)
+		return slots;
+#else
+		return buckets;
+#endif
+	}
+
+	void alloc_storage(uint64_t capacity) {
+		set_storage(_alloc_and_zero(storage_bytes(capacity)), capacity);
+	}
+
+	void free_storage() {
+#ifdef HT_SNAPSHOT
+		if (mapped_bytes) {
+			munmap((char *)storage_base() - HT_SNAPSHOT_DATA_OFFSET, mapped_bytes);
+			mapped_bytes = 0;
+			set_storage(0, 0);
+			return;
+		}
+#endif
+		void *base = storage_base();
+		uint64_t old_capacity = capacity;
+		set_storage(0, 0);
+		free_slots(base, old_capacity);
+	}
+
+	// slots that aren't published anymore. With HT_OPTIMISTIC_READERS a reader may still be on them so they're only retired.
+	void free_slots(void *base, uint64_t capacity) {
+#ifdef HT_OPTIMISTIC_READERS
+		if (base) retire(base, storage_bytes(capacity));
+#else
+		_free(base, storage_bytes(capacity));
+#endif
+	}
+
+	// frees our slots and takes over the slots of other (which is left empty), everything else is left as is.
+	// the new slots are published before the old ones are retired.
+	void take_storage(HT_TABLE *other) {
+#ifdef HT_SNAPSHOT
+		if (mapped_bytes) free_storage();
+#endif
+		void *base = storage_base();
+		uint64_t old_capacity = capacity;
+		set_storage(other->storage_base(), other->capacity);
+		this->length = other->length;
+		other->set_storage(0, 0);
+		other->length = 0;
+#ifdef HT_COMPACT
+		this->overflowed = other->overflowed;
+		other->overflowed = false;
+#endif
+		free_slots(base, old_capacity);
+	}
 
 #ifdef HT_ALLOCATOR
-	HT_NAME(void *allocator, int capacity) {
+	HT_TABLE(void *allocator, Size capacity) {
 		this->allocator = allocator;
 #else
-	HT_NAME(int capacity) {
+	HT_TABLE(Size capacity) {
 #endif
-		this->capacity = capacity;
-		this->buckets = (Bucket *)_alloc_and_zero(capacity * sizeof(Bucket));
+		alloc_storage(capacity);
 
 		this->min_size = capacity;
 		this->length = 0;
+#ifdef HT_COMPACT
+		this->overflowed = false;
+#endif
+#ifdef HT_STATS
+		memset(&this->stats, 0, sizeof(this->stats));
+#endif
+#ifdef HT_INLINE_VALUES
+		this->spill_blocks = 0;
+		this->num_spill_blocks = 0;
+		this->max_spill_blocks = 0;
+		this->free_spill_block = 0;
+		this->num_spilled = 0;
+#endif
+#ifdef HT_STRING_KEYS
+		this->arena = 0;
+		this->arena_length = 0;
+		this->arena_capacity = 0;
+#endif
+#ifdef HT_SEED
+		this->seed = dh_ht_hash_u64((uint64_t)(uintptr_t)this ^ dh_ht_hash_u64((uint64_t)(uintptr_t)storage_base()));
+#endif
+#ifdef HT_INCREMENTAL_RESIZE
+		this->old = 0;
+		this->migrate_pos = 0;
+#endif
+#ifdef HT_SNAPSHOT
+		this->mapped_bytes = 0;
+#endif
+#ifdef HT_OPTIMISTIC_READERS
+		this->version.store(0, std::memory_order_relaxed);
+		this->write_depth = 0;
+		this->epoch.store(1, std::memory_order_relaxed);
+		for (int i = 0; i < HT_OPTIMISTIC_READERS; i++) readers[i].epoch.store(0, std::memory_order_relaxed);
+		this->retired = 0;
+		this->num_retired = 0;
+		this->max_retired = 0;
+#endif
 	}
 #ifdef HT_ALLOCATOR
-	HT_NAME(void *allocator) : HT_NAME(allocator, 128) {
+	HT_TABLE(void *allocator) : HT_TABLE(allocator, 128) {
 	}
 #else
-	HT_NAME() : HT_NAME(128) {
+	HT_TABLE() : HT_TABLE(128) {
 	}
 #endif
 
 
 
-	void resizeTo(int new_capacity) {
+	void resizeTo(Size new_capacity) {
 		if (new_capacity < min_size) return;
+		HT_WRITE_BEGIN
+		HT_STAT(double resize_start = stats_now();)
+#ifdef HT_INCREMENTAL_RESIZE
+		finish_resize();
+#endif
 
 #ifdef HT_ALLOCATOR
-		HT_NAME new_ht(allocator, new_capacity);
+		HT_TABLE new_ht(allocator, new_capacity);
 #else
-		HT_NAME new_ht(new_capacity);
+		HT_TABLE new_ht(new_capacity);
 #endif
 		new_ht.min_size = min_size;
 
-		int new_len = 0;
-		if (length != 0)
-			for (uint64_t i = 0; i < capacity; i++) {
-				if (buckets[i].hash != HT_EMPTY) {
-					int prev_len = new_ht.length;
-					new_ht.insert(buckets[i]);
-					++new_len;
+		if (length != 0) {
+			// start right after an empty slot so no key has some of its values wrapped around to the front,
+			// otherwise they'd come first and a multimap would change their order
+			uint64_t start = 0;
+			while (hash_at(start) != HT_EMPTY) ++start;
+			for (uint64_t n = 1; n <= capacity; n++) {
+				uint64_t i = mask(start + n);
+				if (hash_at(i) != HT_EMPTY) {
+					new_ht.move_in(bucket_at(i));
+					++new_ht.length;
 				}
 			}
+		}
 		assert(new_ht.length == length);
-		_free(buckets, capacity * sizeof(Bucket));
-		*this = new_ht;
+		take_storage(&new_ht);
+#ifdef HT_STRING_KEYS
+		compact_arena(0);
+#endif
+		HT_STAT(++stats.resizes; stats.resize_seconds += stats_now() - resize_start;)
+#ifdef HT_COMPACT
+		if (overflowed) resizeTo(capacity * 2);
+#endif
+		HT_WRITE_END
 	}
 	void maybe_double() {
 		// @Perf we might want to store capacity*growthfactor
 		// that would save a couple of cyckles (we have two converstions there each of 2 cyckles)
 		// plus a mul so 5 cycles. I don't think we pay for the latency though, which is ~20 cycles so thats good
 		if (length >= (uint64_t)(capacity*HT_GROW_FACTOR)) {
+#ifdef HT_INCREMENTAL_RESIZE
+			start_resize();
+#else
 			double_capacity();
+#endif
+		}
+	}
+#ifdef HT_INCREMENTAL_RESIZE
+	// The old slots are emptied from the top down. That way nothing that is still in old has an empty slot in its probe chain
+	// and remove_at on old never shifts anything into the part that has been moved, as long as nothing wraps around the end.
+	// So the entries that do wrap around are moved right away, there's rarely more than a handful.
+	void start_resize() {
+		if (old) finish_resize();
+		HT_STAT(double resize_start = stats_now();)
+		old = (HT_TABLE *)_alloc(sizeof(HT_TABLE));
+#ifdef HT_ALLOCATOR
+		old->allocator = allocator;
+#endif
+		old->set_storage(storage_base(), capacity);
+		old->length = length;
+		old->min_size = capacity; // never shrinks
+		old->old = 0;
+#ifdef HT_SNAPSHOT
+		// old is raw memory, and if our slots are a mapped snapshot the mapping goes with them, old unmaps it when it's done
+		old->mapped_bytes = mapped_bytes;
+		mapped_bytes = 0;
+#endif
+#ifdef HT_STATS
+		// old's own counts are never looked at, they only have to be valid memory
+		memset(&old->stats, 0, sizeof(old->stats));
+#endif
+		alloc_storage(capacity * 2);
+		migrate_pos = old->capacity;
+		while (old->hash_at(0) != HT_EMPTY && old->probe_count(0) != 0) {
+			place(old->bucket_at(0));
+			old->remove_at(0);
+		}
+		// the migration itself is spread over later calls and isn't timed
+		HT_STAT(++stats.resizes; stats.resize_seconds += stats_now() - resize_start;)
+	}
+
+	void migrate_step() {
+		for (int steps = HT_MIGRATE_STEP; steps && migrate_pos; --steps) {
+			--migrate_pos;
+			if (old->hash_at(migrate_pos) != HT_EMPTY) {
+				place(old->bucket_at(migrate_pos));
+				old->clear_bucket(migrate_pos);
+				--old->length;
+			}
+		}
+		if (migrate_pos == 0) {
+			assert(old->length == 0);
+			release_old();
+		}
+	}
+
+	void finish_resize() {
+		while (old) migrate_step();
+	}
+
+	void release_old() {
+		if (!old) return;
+		old->free_storage();
+		_free(old, sizeof(HT_TABLE));
+		old = 0;
+		migrate_pos = 0;
+	}
+
+	// does a migration step and moves the key over right away if it's still in old, so the caller only needs to look in our slots.
+	// hot keys end up moved early this way.
+	template <typename K>
+	void pull_from_old(Hash hash, K key) {
+		migrate_step();
+		uint64_t index;
+		if (old && old->ilookup_hashed(hash, key, &index)) {
+			place(old->bucket_at(index));
+			old->remove_at(index);
 		}
 	}
+#endif
+
+	// after a lot of removes that didn't shrink (retain, iterators), straight to the size length calls for
+	void shrink_to_fit() {
+#ifdef HT_SHRINK_FACTOR
+		Size new_capacity = capacity;
+		while (length < new_capacity*HT_SHRINK_FACTOR && new_capacity > min_size) new_capacity /= 2;
+		if (new_capacity != capacity) resizeTo(new_capacity);
+#endif
+	}
+
 	void maybe_half() {
 #ifdef HT_SHRINK_FACTOR
 		if (length < capacity*HT_SHRINK_FACTOR && capacity > min_size) {
@@ -223,85 +1048,433 @@ struct HT_NAME {
 	}
 
 
-	inline uint32_t hash_key(HT_KEY key) {
+	inline Hash hash_key(HT_KEY key) {
 		// note underscore to avoid name collisions with HT_HASH
-		uint32_t _hash = (uint32_t)HT_HASH(key);
+		return finish_hash(HT_HASH(key));
+	}
+
+	// what the table makes of the result of HT_HASH, for lookup_hashed with keys of some other type
+	inline Hash finish_hash(uint64_t raw) {
+#if defined(HT_SEED) && defined(HT_LARGE)
+		// no wider type to take the high half from, so fold the whole 128 bit product
+		Hash _hash = dh_ht_mum(raw ^ seed, 0x9E3779B97F4A7C15ull);
+#elif defined(HT_SEED)
+		// the high half, the low bits of a multiply only depend on the low bits of the input
+		Hash _hash = (uint32_t)((raw ^ seed) * 0x9E3779B97F4A7C15ull >> 32);
+#else
+		Hash _hash = (Hash)raw;
+#endif
 		_hash |= _hash == 0;
 		return _hash;
 	}
 
+#ifdef HT_SEED
+	// only on an empty table, the hashes of the entries that are in it would be wrong otherwise
+	void set_seed(uint64_t new_seed) {
+		seed = new_seed;
+	}
+#endif
+
 	uint64_t mask(uint64_t hash) {
 		return hash & (capacity - 1);
 	}
 
 	inline uint64_t probe_count(uint64_t index) {
-		return mask(index - buckets[index].hash);
+#ifdef HT_COMPACT
+		return slots[index].dist;
+#else
+		return mask(index - hash_at(index));
+#endif
 	}
 
-	inline bool equal(HT_KEY a, HT_KEY b) {
-		return HT_EQUAL(a, b);
+#ifdef HT_SOA
+	inline Hash &hash_at(uint64_t index) { return hashes[index]; }
+	inline HT_KEY   &key_at(uint64_t index)  { return keys[index]; }
+#ifdef HT_VALUE
+	inline HT_VALUE &value_at(uint64_t index) { return values[index]; }
+	inline Bucket bucket_at(uint64_t index) {
+		Bucket bucket = { keys[index], values[index], hashes[index] };
+		return bucket;
 	}
-
-	inline bool equal(uint32_t hash_a, uint32_t hash_b, HT_KEY a, HT_KEY b) {
-#if HT_FAST_KEY_CMP
-		return equal(a, b);
 #else
-		return hash_a == hash_b && equal(a, b);
+	inline Bucket bucket_at(uint64_t index) {
+		Bucket bucket = { keys[index], hashes[index] };
+		return bucket;
+	}
 #endif
+#elif defined(HT_COMPACT)
+	// what we have of the hash: the home slot in the low bits and the fingerprint above them. Enough for probing, and for moving
+	// an entry within these slots, equal() only compares those bits.
+	inline Hash hash_at(uint64_t index) {
+		if (slots[index].fingerprint == 0) return HT_EMPTY;
+		return (Hash)mask(index - slots[index].dist) | ((Hash)slots[index].fingerprint << fingerprint_shift & ~(Hash)(capacity - 1));
 	}
-
-#ifndef HT_MULTIPLE_VALUES
-	inline void insert(Bucket to_insert) {
+	inline HT_KEY key_at(uint64_t index) { return slots[index].key; }
+#ifdef HT_VALUE
+	inline HT_VALUE value_at(uint64_t index) { return slots[index].value; }
+	inline Bucket bucket_at(uint64_t index) {
+		Bucket bucket = { slots[index].key, slots[index].value, hash_key(slots[index].key) };
+		return bucket;
+	}
+	inline Bucket moving_bucket(uint64_t index) {
+		Bucket bucket = { slots[index].key, slots[index].value, hash_at(index) };
+		return bucket;
+	}
+#else
+	inline Bucket bucket_at(uint64_t index) {
+		Bucket bucket = { slots[index].key, hash_key(slots[index].key) };
+		return bucket;
+	}
+	inline Bucket moving_bucket(uint64_t index) {
+		Bucket bucket = { slots[index].key, hash_at(index) };
+		return bucket;
+	}
+#endif
+	static inline uint8_t fingerprint(Hash hash) { return (uint8_t)(hash >> fingerprint_shift) | 0x80; }
+#else
+	inline Hash &hash_at(uint64_t index) { return buckets[index].hash; }
+	inline HT_KEY   &key_at(uint64_t index)  { return buckets[index].key; }
+#ifdef HT_VALUE
+	inline HT_VALUE &value_at(uint64_t index) { return buckets[index].value; }
+#endif
+	inline Bucket bucket_at(uint64_t index) { return buckets[index]; }
+#ifdef HT_INLINE_VALUES
+	inline uint32_t &spill_at(uint64_t index) { return buckets[index].spill; }
+#endif
+#endif
+
+#ifndef HT_COMPACT
+	// for entries that move to another slot of this table. HT_COMPACT gets away without rehashing the key for those
+	inline Bucket moving_bucket(uint64_t index) { return bucket_at(index); }
+#endif
+
+	// every write to a slot goes through these two so the metadata (if any) stays in sync with the buckets
+#ifdef HT_COMPACT
+	inline void write_bucket(uint64_t index, Bucket bucket) { write_bucket(index, bucket, &overflowed); }
+	// split_into brings its own overflow flag, the resize threads all write into the same table
+	inline void write_bucket(uint64_t index, Bucket bucket, bool *overflow) {
+#else
+	inline void write_bucket(uint64_t index, Bucket bucket) {
+#endif
+#ifdef HT_SOA
+		hashes[index] = bucket.hash;
+		keys[index] = bucket.key;
+#ifdef HT_VALUE
+		values[index] = bucket.value;
+#endif
+#elif defined(HT_COMPACT)
+		uint64_t dist = mask(index - bucket.hash);
+		if (dist > 255) {
+			*overflow = true;
+			dist = 255;
+		}
+		slots[index].key = bucket.key;
+#ifdef HT_VALUE
+		slots[index].value = bucket.value;
+#endif
+		slots[index].dist = (uint8_t)dist;
+		slots[index].fingerprint = fingerprint(bucket.hash);
+#else
+		buckets[index] = bucket;
+#endif
+#ifdef HT_SIMD_PROBE
+		set_meta(index, meta_for(bucket.hash, mask(index - bucket.hash)));
+#endif
+	}
+
+	inline void clear_bucket(uint64_t index) {
+#ifdef HT_COMPACT
+		slots[index].fingerprint = 0;
+#else
+		hash_at(index) = HT_EMPTY;
+#endif
+#ifdef HT_SIMD_PROBE
+		set_meta(index, 0);
+#endif
+	}
+
+	inline bool equal(HT_KEY a, HT_KEY b) {
+		return HT_EQUAL(a, b);
+	}
+
+#ifdef HT_LOOKUP_KEY
+	// a key of ours against a lookup key
+	inline bool equal(HT_KEY a, HT_LOOKUP_KEY b) {
+		return HT_LOOKUP_EQUAL(b, a);
+	}
+#endif
+
+#ifdef HT_STRING_KEYS
+	// the bytes of a key from this table (or made by dh_ht_str). For keys in the arena that's only good until the next insert
+	const char *key_chars(const DH_HT_Str *key) {
+		if (dh_ht_str_length(*key) <= DH_HT_STR_INLINE) return key->prefix; // the tail follows the prefix
+		return (key->length & DH_HT_STR_IN_ARENA) ? arena + key->offset : key->ptr;
+	}
+
+	// short keys are hashed as the two words of the struct (it's zero padded, so that's the same thing as hashing the bytes),
+	// that's one multiply and no branches on the length.
+	inline uint64_t str_hash(const DH_HT_Str &key) {
+		uint32_t len = dh_ht_str_length(key);
+		if (len > DH_HT_STR_INLINE) return dh_ht_hash_bytes(key_chars(&key), len, 0);
+		uint64_t words[2];
+		memcpy(words, &key, sizeof(words));
+		return dh_ht_mum(words[0] ^ 0x2D358DCCAA6C78A5ull, words[1] ^ 0x8BB84B93962EACC9ull);
+	}
+
+	inline bool str_equal(const DH_HT_Str &a, const DH_HT_Str &b) {
+		uint32_t len = dh_ht_str_length(a);
+		if (len != dh_ht_str_length(b)) return false;
+		uint64_t a_words[2], b_words[2];
+		memcpy(a_words, &a, sizeof(a_words));
+		memcpy(b_words, &b, sizeof(b_words));
+		// the length (without the arena bit) and the prefix
+		if ((a_words[0] ^ b_words[0]) & ~(uint64_t)DH_HT_STR_IN_ARENA) return false;
+		if (len <= DH_HT_STR_INLINE) return a_words[1] == b_words[1];
+		return memcmp(key_chars(&a) + sizeof(a.prefix), key_chars(&b) + sizeof(b.prefix), len - sizeof(a.prefix)) == 0;
+	}
+
+	// copies the bytes of a long key that isn't ours yet into the arena
+	DH_HT_Str intern_key(DH_HT_Str key) {
+		uint32_t len = dh_ht_str_length(key);
+		if (len <= DH_HT_STR_INLINE || (key.length & DH_HT_STR_IN_ARENA)) return key;
+		if (arena_length + len > arena_capacity) compact_arena(len);
+		memcpy(arena + arena_length, key.ptr, len);
+		key.offset = arena_length;
+		key.length |= DH_HT_STR_IN_ARENA;
+		arena_length += len;
+		return key;
+	}
+
+	// moves the long keys in the slots into a new arena with room for extra more bytes. Keys that aren't in the arena yet
+	// (insert_bulk writes them as they are) are copied in as well. The extra length is so we don't come back here right away.
+	void compact_arena(uint64_t extra) {
+		uint64_t live = 0;
+		for (uint64_t i = 0; i < capacity; i++) {
+			if (hash_at(i) != HT_EMPTY && dh_ht_str_length(key_at(i)) > DH_HT_STR_INLINE) live += dh_ht_str_length(key_at(i));
+		}
+		if (!live && !extra) {
+			if (arena) _free(arena, arena_capacity);
+			arena = 0;
+			arena_length = arena_capacity = 0;
+			return;
+		}
+		uint64_t new_capacity = 2 * (live + extra) + length;
+		char *new_arena = (char *)_alloc(new_capacity);
+		uint64_t at = 0;
+		for (uint64_t i = 0; i < capacity; i++) {
+			if (hash_at(i) == HT_EMPTY) continue;
+			DH_HT_Str &key = key_at(i);
+			uint32_t len = dh_ht_str_length(key);
+			if (len <= DH_HT_STR_INLINE) continue;
+			memcpy(new_arena + at, key_chars(&key), len);
+			key.offset = at;
+			key.length |= DH_HT_STR_IN_ARENA;
+			at += len;
+		}
+		if (arena) _free(arena, arena_capacity);
+		arena = new_arena;
+		arena_length = at;
+		arena_capacity = new_capacity;
+	}
+#endif
+
+	template <typename K>
+	inline bool equal(Hash hash_a, Hash hash_b, HT_KEY a, K b) {
+#if HT_FAST_KEY_CMP
+		(void)hash_a;
+		(void)hash_b;
+		return equal(a, b);
+#elif defined(HT_COMPACT)
+		// one of them might be from hash_at, which only has the home slot and the fingerprint (not its top bit, that's always set)
+		Hash kept = (Hash)(capacity - 1) | ((Hash)0x7F << fingerprint_shift);
+		return ((hash_a ^ hash_b) & kept) == 0 && equal(a, b);
+#else
+		return hash_a == hash_b && equal(a, b);
+#endif
+	}
+
+#ifdef HT_SIMD_PROBE
+	inline uint8_t meta_for(Hash hash, uint64_t dist) {
+		// the home slot is taken from the low bits so take the fingerprint from a multiply, that way it's not constant within a probe chain
+		uint8_t fingerprint = (uint8_t)((((uint32_t)hash * 0x9E3779B1u) >> 28) << 4);
+		return fingerprint | (uint8_t)(dist < 14 ? dist + 1 : 15);
+	}
+
+	inline void set_meta(uint64_t index, uint8_t m) {
+		// the loop is only there for tables smaller than a group, otherwise it's the slot plus maybe its mirror
+		for (uint64_t i = index; i < capacity + HT_GROUP; i += capacity) meta[i] = m;
+	}
+
+	// compares a whole group of metadata bytes against what the key would look like at each of those slots.
+	// returns the slots where the fingerprint and distance match, *stop gets the slots where robin hood says the key can't be (empty or closer to home)
+	inline uint32_t match_group(uint64_t pos, uint8_t fingerprint, uint64_t dist, uint32_t *stop) {
+		uint8_t d = (uint8_t)(dist < 14 ? dist : 14);
+#if HT_GROUP == 32
+		__m256i m = _mm256_loadu_si256((const __m256i *)(meta + pos));
+		__m256i iota = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+			16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+		__m256i codes = _mm256_add_epi8(_mm256_min_epu8(_mm256_adds_epu8(iota, _mm256_set1_epi8((char)d)), _mm256_set1_epi8(14)), _mm256_set1_epi8(1));
+		__m256i expect = _mm256_or_si256(codes, _mm256_set1_epi8((char)fingerprint));
+		__m256i slot = _mm256_and_si256(m, _mm256_set1_epi8(0x0F));
+		uint32_t ge = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(slot, codes), slot));
+		*stop = ~ge;
+		return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(m, expect));
+#else
+		__m128i m = _mm_loadu_si128((const __m128i *)(meta + pos));
+		__m128i iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+		__m128i codes = _mm_add_epi8(_mm_min_epu8(_mm_adds_epu8(iota, _mm_set1_epi8((char)d)), _mm_set1_epi8(14)), _mm_set1_epi8(1));
+		__m128i expect = _mm_or_si128(codes, _mm_set1_epi8((char)fingerprint));
+		__m128i slot = _mm_and_si128(m, _mm_set1_epi8(0x0F));
+		uint32_t ge = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(slot, codes), slot));
+		*stop = ~ge & 0xFFFF;
+		return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(m, expect));
+#endif
+	}
+
+	// on a hit *idx is the slot of the key. on a miss *idx and *dist is where the key would go if inserted.
+	template <typename K>
+	inline bool probe(Hash hash, K key, uint64_t *idx, uint64_t *dist) {
+		uint8_t fingerprint = meta_for(hash, 0) & 0xF0;
+		uint64_t pos = mask(hash);
+		uint64_t d = 0;
+		for (;;) {
+			uint32_t stop;
+			uint32_t match = match_group(pos, fingerprint, d, &stop);
+			uint32_t first_stop = stop ? dh_ht_ctz(stop) : HT_GROUP;
+			if (first_stop < HT_GROUP) match &= (1u << first_stop) - 1;
+			while (match) {
+				uint64_t i = mask(pos + dh_ht_ctz(match));
+				if (equal(hash_at(i), hash, key_at(i), key)) {
+					*idx = i;
+					return true;
+				}
+				match &= match - 1;
+			}
+			if (first_stop < HT_GROUP) {
+				*idx = mask(pos + first_stop);
+				*dist = d + first_stop;
+				return false;
+			}
+			pos = mask(pos + HT_GROUP);
+			d += HT_GROUP;
+		}
+	}
+#endif
+
+	// robin hood for an entry whose key isn't in the table, starting at the slot where a lookup of it stopped (dist is how far
+	// that is from home). no key compares. returns the slot the entry itself ends up in.
+	inline uint64_t place_from(uint64_t pos, uint64_t dist, Bucket to_insert) {
+#ifdef HT_SIMD_PROBE
+		// distances saturate in the metadata so past 14 the stop might be late, redo that part the slow way.
+		if (dist > 14) {
+			pos = mask(pos - (dist - 14));
+			dist = 14;
+		}
+#endif
+		uint64_t landed = capacity; // capacity as in not yet
+		for (;;) {
+			if (hash_at(pos) == HT_EMPTY) {
+				write_bucket(pos, to_insert);
+				return landed == capacity ? pos : landed;
+			}
+			uint64_t other_dist = probe_count(pos);
+			if (dist > other_dist) {
+				Bucket tmp = moving_bucket(pos);
+				write_bucket(pos, to_insert);
+				if (landed == capacity) landed = pos;
+				to_insert = tmp;
+				dist = other_dist;
+				HT_STAT(++stats.insert_swaps;)
+			}
+			++dist;
+			pos = mask(pos + 1);
+		}
+	}
+
+	// for entries coming over from another slots array when resizing. They're distinct already so there's nothing to compare,
+	// and with HT_STRING_KEYS they couldn't be compared anyway, their keys still point into the arena of the table they come from.
+	inline void move_in(Bucket bucket) {
+#ifdef HT_MULTIPLE_VALUES
+		place(bucket); // the compares keep the values of a key together and in order
+#else
+		place_from(mask(bucket.hash), 0, bucket);
+#endif
+	}
+
+	// place puts an entry in the slots, it returns true if it took a new slot and false if it overwrote the value of an equal key.
+	// it doesn't touch length or grow the table, that's up to insert.
+#ifndef HT_MULTIPLE_VALUES
+	inline bool place(Bucket to_insert) {
+#ifdef HT_SIMD_PROBE
+		uint64_t pos, dist;
+		if (probe(to_insert.hash, to_insert.key, &pos, &dist)) {
+			#ifdef HT_VALUE
+			value_at(pos) = to_insert.value;
+			#endif
+			return false;
+		}
+		// pos is either empty or closer to home than us, from here on it's plain robin hood without any key compares.
+		place_from(pos, dist, to_insert);
+		return true;
+#else
 		uint64_t pos = mask(to_insert.hash);
 		uint64_t dist = 0;
 		for (;;) {
-			if (buckets[pos].hash == HT_EMPTY) {
-				buckets[pos] = to_insert;
-				++length;
-				maybe_double();
-				return;
+			if (hash_at(pos) == HT_EMPTY) {
+				write_bucket(pos, to_insert);
+				return true;
 			} else {
-				if (equal(to_insert.hash, buckets[pos].hash, to_insert.key, buckets[pos].key)) {
-					#ifdef HT_VALUE
-					buckets[pos].value = to_insert.value;
+				if (equal(to_insert.hash, hash_at(pos), to_insert.key, key_at(pos))) {
+					#if defined(HT_VALUE) && defined(HT_COMPACT)
+					slots[pos].value = to_insert.value;
+					#elif defined(HT_VALUE)
+					value_at(pos) = to_insert.value;
 					#endif
-					return;
+					return false;
 				}
 				uint64_t other_dist = probe_count(pos);
 				if (dist > other_dist) {
-					assert(to_insert.key == to_insert.value);
-					assert(buckets[pos].key == buckets[pos].value);
-					HT_SWAP(Bucket, buckets[pos], to_insert);
+					Bucket tmp = moving_bucket(pos);
+					write_bucket(pos, to_insert);
+					to_insert = tmp;
 					dist = other_dist;
+					HT_STAT(++stats.insert_swaps;)
 				}
 			}
 			++dist;
 			pos = mask(pos + 1);
 		}
+#endif
 	}
 #else
-	inline void insert(Bucket to_insert) {
+	inline bool place(Bucket to_insert) {
 		uint64_t pos = mask(to_insert.hash);
 		uint64_t prev_pos = mask(pos - 1);
 		uint64_t dist = 0;
+		// once we carry an entry that got pushed out it has to push the rest of its key along in front of it,
+		// otherwise it would end up behind them and the values of a key would change order
+		bool displaced = false;
 		for (;;) {
-			if (buckets[pos].hash == HT_EMPTY) {
-				buckets[pos] = to_insert;
-				++length;
-				maybe_double();
-				return;
+			if (hash_at(pos) == HT_EMPTY) {
+				write_bucket(pos, to_insert);
+				return true;
 			} else {
 				uint64_t other_dist = probe_count(pos);
 				if (dist > other_dist 
-					|| equal(to_insert.hash,buckets[prev_pos].hash,to_insert.key,buckets[prev_pos].key)
+					|| equal(to_insert.hash,hash_at(prev_pos),to_insert.key,key_at(prev_pos))
 					#ifdef HT_MULTIPLE_VALUES_ORDERED 
 					// note this can probably be speed up a bit but that would complicate the code 
 					// more than I like to atm.
-						&& !equal(to_insert.hash, buckets[pos].hash, to_insert.key, buckets[pos].key)
+						&& !equal(to_insert.hash, hash_at(pos), to_insert.key, key_at(pos))
 					#endif		
+					|| (displaced && equal(to_insert.hash, hash_at(pos), to_insert.key, key_at(pos)))
 					) {
-					HT_SWAP(Bucket, buckets[pos], to_insert);
+					Bucket tmp = bucket_at(pos);
+					write_bucket(pos, to_insert);
+					to_insert = tmp;
 					dist = other_dist;
+					displaced = true;
+					HT_STAT(++stats.insert_swaps;)
 				}
 			}
 			++dist;
@@ -311,6 +1484,161 @@ struct HT_NAME {
 	}
 #endif
 
+	inline void insert(Bucket to_insert) {
+		HT_WRITE_BEGIN
+#ifdef HT_INCREMENTAL_RESIZE
+		if (old) pull_from_old(to_insert.hash, to_insert.key);
+#endif
+#ifdef HT_INLINE_VALUES
+		// once a key has spilled all its new values go there, that way HT_MULTIPLE_VALUES_ORDERED still holds
+		uint64_t first;
+		if (ilookup_hashed(to_insert.hash, to_insert.key, &first)) {
+			uint64_t in_table = 1;
+			while (in_table < HT_INLINE_VALUES && hash_at(mask(first + in_table)) == to_insert.hash
+				&& equal(key_at(mask(first + in_table)), to_insert.key)) ++in_table;
+			if (spill_at(first) || in_table >= HT_INLINE_VALUES) {
+				spill_push(first, to_insert.value);
+				HT_WRITE_END
+				return;
+			}
+		}
+		to_insert.spill = 0;
+#endif
+#ifdef HT_STRING_KEYS
+		// the key has to be in the arena before place writes it anywhere. If the table already had it (only the value changes)
+		// the bytes we just appended are the last ones in the arena, so they're simply dropped again
+		bool interned = dh_ht_str_length(to_insert.key) > DH_HT_STR_INLINE && !(to_insert.key.length & DH_HT_STR_IN_ARENA);
+		to_insert.key = intern_key(to_insert.key);
+		uint64_t arena_mark = to_insert.key.offset;
+#endif
+		if (place(to_insert)) {
+			++length;
+			HT_STAT(++stats.inserts;)
+			maybe_double();
+		}
+#ifdef HT_COMPACT
+		if (overflowed) resizeTo(capacity * 2);
+#endif
+#ifdef HT_STRING_KEYS
+		else if (interned) arena_length = arena_mark;
+#endif
+		HT_WRITE_END
+	}
+
+#ifdef HT_INLINE_VALUES
+	uint32_t spill_alloc() {
+		if (free_spill_block) {
+			uint32_t handle = free_spill_block;
+			free_spill_block = spill_blocks[handle - 1].count;
+			spill_blocks[handle - 1].count = 0;
+			return handle;
+		}
+		if (num_spill_blocks == max_spill_blocks) {
+			uint32_t new_max = max_spill_blocks ? max_spill_blocks * 2 : 16;
+			SpillBlock *blocks = (SpillBlock *)_alloc(new_max * sizeof(SpillBlock));
+			if (num_spill_blocks) memcpy(blocks, spill_blocks, num_spill_blocks * sizeof(SpillBlock));
+			if (spill_blocks) _free(spill_blocks, max_spill_blocks * sizeof(SpillBlock));
+			spill_blocks = blocks;
+			max_spill_blocks = new_max;
+		}
+		SpillBlock *block = &spill_blocks[num_spill_blocks++];
+		block->values = 0;
+		block->count = 0;
+		block->capacity = 0;
+		return num_spill_blocks;
+	}
+
+	// frees the values and puts the block on the free list
+	void spill_free(uint32_t handle) {
+		SpillBlock *block = &spill_blocks[handle - 1];
+		num_spilled -= block->count;
+		if (block->values) _free(block->values, block->capacity * sizeof(HT_VALUE));
+		block->values = 0;
+		block->capacity = 0;
+		block->count = free_spill_block;
+		free_spill_block = handle;
+	}
+
+	void spill_release_all() {
+		for (uint32_t i = 0; i < num_spill_blocks; i++) {
+			if (spill_blocks[i].values) _free(spill_blocks[i].values, spill_blocks[i].capacity * sizeof(HT_VALUE));
+		}
+		if (spill_blocks) _free(spill_blocks, max_spill_blocks * sizeof(SpillBlock));
+		spill_blocks = 0;
+		num_spill_blocks = max_spill_blocks = free_spill_block = 0;
+		num_spilled = 0;
+	}
+
+	void spill_push(uint64_t first, HT_VALUE value) {
+		spill_append(&spill_at(first), value);
+	}
+
+	// *handle is 0 if there's no block yet (it gets one then)
+	void spill_append(uint32_t *handle, HT_VALUE value) {
+		if (!*handle) *handle = spill_alloc();
+		SpillBlock *block = &spill_blocks[*handle - 1];
+		if (block->count == block->capacity) {
+			uint32_t new_capacity = block->capacity ? block->capacity * 2 : 16;
+			HT_VALUE *values = (HT_VALUE *)_alloc(new_capacity * sizeof(HT_VALUE));
+			if (block->count) memcpy(values, block->values, block->count * sizeof(HT_VALUE));
+			if (block->values) _free(block->values, block->capacity * sizeof(HT_VALUE));
+			block->values = values;
+			block->capacity = new_capacity;
+		}
+		block->values[block->count++] = value;
+		++num_spilled;
+	}
+
+	// returns true if that was the last one and the block is gone
+	bool spill_remove_value(uint32_t handle, uint32_t pos) {
+		SpillBlock *block = &spill_blocks[handle - 1];
+#ifdef HT_MULTIPLE_VALUES_ORDERED
+		memmove(block->values + pos, block->values + pos + 1, (block->count - pos - 1) * sizeof(HT_VALUE));
+		--block->count;
+#else
+		block->values[pos] = block->values[--block->count];
+#endif
+		--num_spilled;
+		if (block->count != 0) return false;
+		spill_free(handle);
+		return true;
+	}
+
+	// first is the slot of the key with the spill handle
+	void remove_spilled(uint64_t first, uint32_t pos) {
+		if (spill_remove_value(spill_at(first), pos)) spill_at(first) = 0;
+	}
+
+	// A key that has spilled values always keeps a bucket in the table, the handle is in it. So if that's the last one it gets
+	// the first spilled value instead of being removed, and if it isn't the handle is moved to the next one before remove_at shifts that in.
+	// returns true if slot was refilled that way.
+	bool remove_inline_value(uint64_t first, uint64_t slot, bool may_shrink = true) {
+		uint32_t handle = spill_at(first);
+		if (handle && slot == first) {
+			uint64_t next = mask(slot + 1);
+			if (hash_at(next) == hash_at(first) && equal(key_at(next), key_at(first))) {
+				spill_at(next) = handle;
+			} else {
+				value_at(slot) = spill_blocks[handle - 1].values[0];
+				remove_spilled(first, 0);
+				return true;
+			}
+		}
+		remove_at(slot, may_shrink);
+		return false;
+	}
+
+	// the first slot of the key in slot
+	uint64_t run_start(uint64_t slot) {
+		while (probe_count(slot) != 0) {
+			uint64_t prev = mask(slot - 1);
+			if (hash_at(prev) != hash_at(slot) || !equal(key_at(prev), key_at(slot))) break;
+			slot = prev;
+		}
+		return slot;
+	}
+#endif
+
 
 
 #ifdef HT_VALUE
@@ -328,16 +1656,52 @@ struct HT_NAME {
 
 
 	inline bool ilookup(HT_KEY key, uint64_t *idx) {
-		uint32_t hash = hash_key(key);
+		return ilookup_hashed(hash_key(key), key, idx);
+	}
+
+	// same as ilookup but with hash = hash_key(key) already computed
+	// K is HT_KEY or HT_LOOKUP_KEY
+	template <typename K>
+	inline bool ilookup_hashed(Hash hash, K key, uint64_t *idx) {
+#ifdef HT_INCREMENTAL_RESIZE
+		if (old) pull_from_old(hash, key);
+#endif
+#ifdef HT_STATS
+		bool found = find(hash, key, idx);
+		// on a miss idx is where we stopped
+		stats_count(found ? stats.hit_probes : stats.miss_probes, mask(*idx - hash));
+		return found;
+#else
+		return find(hash, key, idx);
+#endif
+	}
+
+	template <typename K>
+	inline bool find(Hash hash, K key, uint64_t *idx) {
+#ifdef HT_SIMD_PROBE
+		uint64_t dist;
+		return probe(hash, key, idx, &dist);
+#elif defined(HT_COMPACT)
+		// same home slot means same dist at the same index, so there's no need to put the hash back together
+		*idx = mask(hash);
+		uint8_t fp = fingerprint(hash);
+		for (uint64_t dist = 0;; dist++) {
+			Slot *slot = &slots[*idx];
+			if (slot->fingerprint == 0 || dist > slot->dist) return false;
+			if (slot->fingerprint == fp && slot->dist == dist && equal(slot->key, key)) return true;
+			*idx = mask(*idx + 1);
+		}
+#else
 		*idx = mask(hash);
 		uint64_t dist = 0;
 		for (;;) {
-			if (buckets[*idx].hash == HT_EMPTY) return false;
-			else if (equal(buckets[*idx].hash, hash, buckets[*idx].key, key)) return true;
+			if (hash_at(*idx) == HT_EMPTY) return false;
+			else if (equal(hash_at(*idx), hash, key_at(*idx), key)) return true;
 			else if (dist > probe_count(*idx))  return false;
 			*idx = mask(*idx + 1);
 			++dist;
 		}
+#endif
 	}
 #ifdef HT_MULTIPLE_VALUES
 	inline void remove_all_at(uint64_t index) { // Note, no checking, buckets[index] better not be empty
@@ -346,46 +1710,63 @@ struct HT_NAME {
 		// but this should be way faster if otherwise especcially on long probe chains.. 
 		// for now this seems fine. 
 
+		HT_WRITE_BEGIN
 		assert(index == mask(index));
+#ifdef HT_INLINE_VALUES
+		if (spill_at(index)) {
+			spill_free(spill_at(index));
+			spill_at(index) = 0;
+		}
+#endif
 		uint64_t read = index;
 		uint64_t write = index;
 		bool cont;
 
 		do {
 			uint64_t nxt_read = mask(read + 1);
-			cont = buckets[read].hash == buckets[nxt_read].hash && equal(buckets[read].key, buckets[nxt_read].key);
-			buckets[read].hash = HT_EMPTY;
+			cont = hash_at(read) == hash_at(nxt_read) && equal(key_at(read), key_at(nxt_read));
+			clear_bucket(read);
 			--length;
+			HT_STAT(++stats.removes;)
 			read = nxt_read;
 		} while (cont);
 
+		HT_STAT(uint64_t shifted = 0;)
 		for (;;) {
-			if (buckets[read].hash == HT_EMPTY)  break;
+			if (hash_at(read) == HT_EMPTY)  break;
 			uint64_t pc = probe_count(read);
 			if (pc == 0) break;
-			write = mask(read-(min(mask(read-write),pc))); //heyo this is some mess all right...
-			buckets[write] = buckets[read];
-			buckets[read].hash = HT_EMPTY;
+			write = mask(read-(dh_ht_min(mask(read-write),pc))); //heyo this is some mess all right...
+			write_bucket(write, bucket_at(read));
+			clear_bucket(read);
 			read = mask(read + 1);
 			write = mask(write + 1); 
+			HT_STAT(++shifted;)
 		}
+		HT_STAT(stats_count(stats.shift_lengths, shifted);)
 		maybe_half();
+		HT_WRITE_END
 	}
 #endif
-	inline void remove_at(uint64_t index) { // Note, no checking, buckets[index] better not be empty
-		buckets[index].hash = HT_EMPTY;
+	// may_shrink is false for the iterators, they shrink when they're done
+	inline void remove_at(uint64_t index, bool may_shrink = true) { // Note, no checking, buckets[index] better not be empty
+		HT_WRITE_BEGIN
+		clear_bucket(index);
+		HT_STAT(uint64_t shifted = 0;)
 		for (;;) {
 			uint64_t prev_index = index;
 			index = mask(index + 1);
-			if (buckets[index].hash == HT_EMPTY)  break;
+			if (hash_at(index) == HT_EMPTY)  break;
 			if (probe_count(index) == 0)          break;
-			buckets[prev_index] = buckets[index];
-			buckets[index].hash = HT_EMPTY;
+			write_bucket(prev_index, moving_bucket(index));
+			clear_bucket(index);
+			HT_STAT(++shifted;)
 		}
+		HT_STAT(++stats.removes; stats_count(stats.shift_lengths, shifted);)
 		--length;
-		maybe_half();
+		if (may_shrink) maybe_half();
+		HT_WRITE_END
 	}
-
 	bool remove(HT_KEY key) {
 		uint64_t index;
 		if (!ilookup(key, &index))return false;
@@ -405,19 +1786,132 @@ struct HT_NAME {
 		return true;
 	}
 
+	// removes every entry keep(bucket) says false to in a single pass over the slots. Each entry that stays is moved back over
+	// the holes in front of it (as far as its probe count allows, same as remove_all_at) so there's no shift per remove,
+	// and we shrink at most once at the end. keep gets a const Bucket & and must not touch the table.
+	// With HT_INLINE_VALUES the spilled values go through keep too. Returns how many values were removed.
+	template <typename Keep>
+	uint64_t retain(Keep keep) {
+		HT_WRITE_BEGIN
+#ifdef HT_INCREMENTAL_RESIZE
+		finish_resize();
+#endif
+		uint64_t before = length;
+#ifdef HT_INLINE_VALUES
+		before += num_spilled;
+#endif
+		if (length != 0) {
+			// start right after an empty slot, so nothing before the first slot we look at can move into it
+			uint64_t start = 0;
+			while (hash_at(start) != HT_EMPTY) ++start;
+			uint64_t write = mask(start + 1); // where the next entry would go if nothing was in its way
+			uint64_t kept = 0;
+#ifdef HT_INLINE_VALUES
+			uint32_t handle = 0; // the spill handle of the current key, until one of its buckets stays
+#endif
+			for (uint64_t n = 1; n <= capacity; n++) {
+				uint64_t read = mask(start + n);
+				if (hash_at(read) == HT_EMPTY) {
+					write = mask(read + 1);
+					continue;
+				}
+				Bucket bucket = bucket_at(read);
+#ifdef HT_INLINE_VALUES
+				// only the first bucket of a key has a handle, so that's where we go through the spilled values
+				if (bucket.spill) {
+					handle = bucket.spill;
+					bucket.spill = 0;
+					SpillBlock *block = &spill_blocks[handle - 1];
+					Bucket spilled = bucket;
+					uint32_t count = 0;
+					for (uint32_t i = 0; i < block->count; i++) {
+						spilled.value = block->values[i];
+						if (keep((const Bucket &)spilled)) block->values[count++] = spilled.value;
+					}
+					num_spilled -= block->count - count;
+					block->count = count;
+					if (count == 0) {
+						spill_free(handle);
+						handle = 0;
+					}
+				}
+				bool stays = keep((const Bucket &)bucket);
+				if (handle) {
+					// the last bucket of the key is going and none stayed, so it takes the first spilled value instead
+					uint64_t next = mask(read + 1);
+					if (!stays && (hash_at(next) != bucket.hash || !equal(key_at(next), bucket.key))) {
+						bucket.value = spill_blocks[handle - 1].values[0];
+						if (spill_remove_value(handle, 0)) handle = 0;
+						stays = true;
+					}
+					if (stays) {
+						bucket.spill = handle;
+						handle = 0;
+					}
+				}
+				// the bucket might have a different value/handle now, so it's always written back
+				bool changed = true;
+#else
+				bool stays = keep((const Bucket &)bucket);
+				bool changed = false;
+#endif
+				if (!stays) {
+					clear_bucket(read);
+					continue;
+				}
+				// most entries don't move at all, those slots aren't written to
+				write = mask(read - dh_ht_min(mask(read - write), mask(read - bucket.hash)));
+				if (write != read) {
+					clear_bucket(read);
+					write_bucket(write, bucket);
+				} else if (changed) {
+					write_bucket(write, bucket);
+				}
+				write = mask(write + 1);
+				++kept;
+			}
+			length = kept;
+		}
+		uint64_t removed = before - length;
+#ifdef HT_INLINE_VALUES
+		removed -= num_spilled;
+#endif
+		HT_STAT(stats.removes += removed;)
+		shrink_to_fit();
+		HT_WRITE_END
+		return removed;
+	}
+
+	template <typename Remove>
+	uint64_t erase_if(Remove remove) {
+		return retain([&](const Bucket &bucket) { return !remove(bucket); });
+	}
+
 #ifdef HT_MULTIPLE_VALUES
 bool lookup(HT_KEY key, ValueIterator *it) {
-	it->ht = this;
 	bool ret = ilookup(key, &it->idx);
-	it->fst_key = buckets[it->idx].key;
-	it->fst_hash = buckets[it->idx].hash;
+	init_value_iterator(it, it->idx, ret);
 	return ret;
 }
+
+inline void init_value_iterator(ValueIterator *it, uint64_t index, bool found) {
+	it->ht = this;
+	it->idx = index;
+	it->removed = false;
+	it->fst_key = key_at(index);
+	it->fst_hash = hash_at(index);
+#ifdef HT_INLINE_VALUES
+	it->first = index;
+	it->spill = found ? spill_at(index) : 0; // on a miss index isn't our key
+	it->spill_pos = 0;
+	it->inline_done = false;
+#endif
+}
 #elif defined HT_VALUE
 	bool lookup(HT_KEY key, HT_VALUE *value) {
 		uint64_t index;
 		if (!ilookup(key, &index)) return false;
-		*value = buckets[index].value;
+		*value = value_at(index);
 		return true;
 	}
 #else
@@ -427,82 +1921,1167 @@ bool lookup(HT_KEY key, ValueIterator *it) {
 	}
 #endif
 
-	void destroy() {
-		_free(buckets, capacity * sizeof(Bucket));
-		this->capacity = 0;
-		this->length = 0;
-		this->buckets = 0;
+	// lookup with the hash already done: hash_key(key), or for an HT_LOOKUP_KEY finish_hash of what HT_HASH gives for the equal key.
+	// Saves hashing twice when the caller needs the hash anyway, and lets you look up without building an HT_KEY first.
+#ifdef HT_MULTIPLE_VALUES
+	bool lookup_hashed(Hash hash, LookupKey key, ValueIterator *it) {
+		bool ret = ilookup_hashed(hash, key, &it->idx);
+		init_value_iterator(it, it->idx, ret);
+		return ret;
+	}
+#elif defined HT_VALUE
+	bool lookup_hashed(Hash hash, LookupKey key, HT_VALUE *value) {
+		uint64_t index;
+		if (!ilookup_hashed(hash, key, &index)) return false;
+		*value = value_at(index);
+		return true;
+	}
+#else
+	bool lookup_hashed(Hash hash, LookupKey key) {
+		uint64_t index;
+		return ilookup_hashed(hash, key, &index);
 	}
+#endif
 
-	void clear() {
-		length = 0;
-		memset(buckets, 0, sizeof(Bucket)*capacity);
+#if defined(HT_VALUE) && !defined(HT_MULTIPLE_VALUES)
+	// the slot of key, after putting it in with HT_VALUE() if it wasn't there. *inserted says which it was.
+	// One probe either way: a miss stops right where robin hood wants the key, so it goes in from there without searching again.
+	uint64_t find_or_insert_index(HT_KEY key, bool *inserted) {
+		return find_or_insert_index_hashed(hash_key(key), key, inserted);
 	}
 
-	void clear_and_shrink() {
-		destroy();
-		*this = HT_NAME(min_size);
+	uint64_t find_or_insert_index_hashed(Hash hash, HT_KEY key, bool *inserted) {
+		HT_WRITE_BEGIN
+		uint64_t index;
+		*inserted = !ilookup_hashed(hash, key, &index);
+		if (*inserted) {
+			Bucket to_insert;
+			to_insert.key = key;
+			to_insert.value = HT_VALUE();
+			to_insert.hash = hash;
+#ifdef HT_STRING_KEYS
+			to_insert.key = intern_key(to_insert.key);
+#endif
+			index = place_from(index, mask(index - hash), to_insert);
+			++length;
+			HT_STAT(++stats.inserts;)
+			Size old_capacity = capacity;
+			maybe_double();
+#ifdef HT_COMPACT
+			if (overflowed) resizeTo(capacity * 2);
+#endif
+			// a resize moved it
+			if (capacity != old_capacity) ilookup_hashed(hash, key, &index);
+		}
+		HT_WRITE_END
+		return index;
 	}
 
-	void double_capacity() {
-#ifdef HT_ALLOCATOR
-		HT_NAME new_ht(allocator, capacity * 2);
-#else
-		HT_NAME new_ht(capacity * 2);
+#ifndef HT_COMPACT
+	// the value of key, HT_VALUE() if it's new. The pointer is good until the next insert or remove
+	// (and with HT_OPTIMISTIC_READERS writes through it aren't seen as writes, use update for those)
+	HT_VALUE *find_or_insert(HT_KEY key, bool *inserted) {
+		return &value_at(find_or_insert_index(key, inserted));
+	}
 #endif
-		new_ht.min_size = min_size;
-		int old_len = length;
-		// find the first bucket that hasn't wrapped around
-		uint64_t fst;
-		for (fst = 0; buckets[fst].hash != HT_EMPTY && mask(buckets[fst].hash) > fst; ++fst);
-		length -= fst;
-		new_ht.length = length;
 
-		uint64_t low = 0;
-		uint64_t high = capacity;
-		for (uint64_t i = fst; i < capacity; i++) {
-			if (buckets[i].hash == HT_EMPTY) continue;
-			if (buckets[i].hash & capacity) { // do we go to high or low half of the new hashtable
-				high = max(high, new_ht.mask(buckets[i].hash));
-				new_ht.buckets[high++] = buckets[i];
-			} else {
-				low = max(low, new_ht.mask(buckets[i].hash));
-				new_ht.buckets[low++] = buckets[i];
-			}
-		}
+	// calls fn(HT_VALUE *value) on the value of key, which starts out as HT_VALUE() if the key is new. Returns true if it was.
+	// e.g. counting: ht.update(word, [](int *count) { ++*count; });
+	template <typename Fn>
+	bool update(HT_KEY key, Fn fn) {
+		return update_hashed(hash_key(key), key, fn);
+	}
 
-		for (uint64_t i = 0; i < fst; i++) {
-			new_ht.insert(buckets[i]);
-		}
+	template <typename Fn>
+	bool update_hashed(Hash hash, HT_KEY key, Fn fn) {
+		HT_WRITE_BEGIN
+		bool inserted;
+		uint64_t index = find_or_insert_index_hashed(hash, key, &inserted);
+#ifdef HT_COMPACT
+		// the value sits in a packed slot, go through a copy
+		HT_VALUE value = slots[index].value;
+		fn(&value);
+		slots[index].value = value;
+#else
+		fn(&value_at(index));
+#endif
+		HT_WRITE_END
+		return inserted;
+	}
+#endif
 
-		destroy();
-		*this = new_ht;
+	// pulls in whatever the first probe of a key with this home slot will touch
+	inline void prefetch_slot(uint64_t index) {
+#ifdef HT_SIMD_PROBE
+		DH_HT_PREFETCH(meta + index);
+#endif
+#ifdef HT_SOA
+		DH_HT_PREFETCH(hashes + index);
+		DH_HT_PREFETCH(keys + index);
+#elif defined(HT_COMPACT)
+		DH_HT_PREFETCH(slots + index);
+#else
+		DH_HT_PREFETCH(buckets + index);
+#endif
 	}
 
-	struct Iterator {
-		int idx;
-		HT_NAME *ht;
-		bool next(Bucket *bucket) {
-			while (idx < ht->capacity) {
-				if (ht->buckets[idx].hash != HT_EMPTY) {
-					*bucket = ht->buckets[idx];
-					++idx;
-					return true;
-				}
-				++idx;
+	// The batch functions do group prefetching: the keys are hashed HT_BATCH_SIZE at a time and their home slots are prefetched
+	// one group ahead of the group being resolved, so up to two groups of cache misses are in flight instead of one.
+	// The results are the same as calling lookup/insert on every key in order.
+#ifdef HT_MULTIPLE_VALUES
+	void lookup_batch(const Key *in_keys, uint64_t n, ValueIterator *out, bool *found) {
+#elif defined HT_VALUE
+	void lookup_batch(const Key *in_keys, uint64_t n, HT_VALUE *out, bool *found) {
+#else
+	void lookup_batch(const Key *in_keys, uint64_t n, bool *found) {
+#endif
+		Hash batch_hashes[2][HT_BATCH_SIZE];
+		uint64_t count = dh_ht_min(n, (uint64_t)HT_BATCH_SIZE);
+		for (uint64_t i = 0; i < count; i++) {
+			batch_hashes[0][i] = hash_key(in_keys[i]);
+			prefetch_slot(mask(batch_hashes[0][i]));
+		}
+		for (uint64_t base = 0, group = 0; base < n; base += HT_BATCH_SIZE, group ^= 1) {
+			uint64_t next = base + HT_BATCH_SIZE;
+			uint64_t next_count = next < n ? dh_ht_min(n - next, (uint64_t)HT_BATCH_SIZE) : 0;
+			for (uint64_t i = 0; i < next_count; i++) {
+				batch_hashes[group ^ 1][i] = hash_key(in_keys[next + i]);
+				prefetch_slot(mask(batch_hashes[group ^ 1][i]));
+			}
+			count = dh_ht_min(n - base, (uint64_t)HT_BATCH_SIZE);
+			for (uint64_t i = 0; i < count; i++) {
+				uint64_t index;
+				found[base + i] = ilookup_hashed(batch_hashes[group][i], in_keys[base + i], &index);
+#ifdef HT_MULTIPLE_VALUES
+				init_value_iterator(&out[base + i], index, found[base + i]);
+#elif defined HT_VALUE
+				if (found[base + i]) out[base + i] = value_at(index);
+#endif
 			}
-			return false;
 		}
+	}
 
-		void remove() {
-			ht->remove_at(--idx);
-			if (ht->buckets[idx].hash == HT_EMPTY)++idx;
+	// insert can grow the table half way through a group, that just makes the rest of those prefetches useless, not wrong.
+#ifdef HT_VALUE
+	void insert_batch(const Key *in_keys, const Value *in_values, uint64_t n) {
+#else
+	void insert_batch(const Key *in_keys, uint64_t n) {
+#endif
+		Bucket batch[2][HT_BATCH_SIZE];
+		for (uint64_t base = 0, group = 0; base < n + HT_BATCH_SIZE; base += HT_BATCH_SIZE, group ^= 1) {
+			// hash and prefetch the group at base while inserting the one before it
+			uint64_t count = base < n ? dh_ht_min(n - base, (uint64_t)HT_BATCH_SIZE) : 0;
+			for (uint64_t i = 0; i < count; i++) {
+				Bucket *bucket = &batch[group][i];
+				bucket->key = in_keys[base + i];
+#ifdef HT_VALUE
+				bucket->value = in_values[base + i];
+#endif
+				bucket->hash = hash_key(bucket->key);
+				prefetch_slot(mask(bucket->hash));
+			}
+			if (base == 0) continue;
+			uint64_t prev_count = dh_ht_min(n - (base - HT_BATCH_SIZE), (uint64_t)HT_BATCH_SIZE);
+			for (uint64_t i = 0; i < prev_count; i++) {
+				insert(batch[group ^ 1][i]);
+			}
 		}
+	}
+
+	// Inserts n entries in O(length + n): everything (old and new) is radix sorted by home slot and then written out in one
+	// sequential pass, which gives the same layout robin hood would. Same result as inserting them one by one, later entries
+	// overwrite the values of earlier ones with the same key. The hash in the entries is ignored.
+	// Needs two temporary arrays of length + n buckets.
+	void insert_bulk(const Bucket *entries, uint64_t n) {
+		if (n == 0) return;
+#ifdef HT_INLINE_VALUES
+		// marks the entries that are new in the spill field while they're sorted, the ones from the table have a handle or 0
+		const uint32_t bulk_new = ~(uint32_t)0;
+#endif
+		HT_WRITE_BEGIN
+#ifdef HT_INCREMENTAL_RESIZE
+		finish_resize();
+#endif
+		uint64_t total = length + n;
+		uint64_t new_capacity = capacity;
+		while (total >= (uint64_t)(new_capacity * HT_GROW_FACTOR)) new_capacity *= 2;
+		uint64_t new_mask = new_capacity - 1;
+
+		Bucket *sorted = (Bucket *)_alloc(total * sizeof(Bucket));
+		Bucket *scratch = (Bucket *)_alloc(total * sizeof(Bucket));
+		uint64_t count = 0;
+		if (length) {
+			// from an empty slot on so the values of a key that wraps around stay in order
+			uint64_t start = 0;
+			while (hash_at(start) != HT_EMPTY) ++start;
+			for (uint64_t i = 1; i <= capacity; i++) {
+				if (hash_at(mask(start + i)) != HT_EMPTY) sorted[count++] = bucket_at(mask(start + i));
+			}
+		}
+		for (uint64_t i = 0; i < n; i++) {
+			sorted[count] = entries[i];
+			sorted[count].hash = hash_key(entries[i].key);
+#ifdef HT_INLINE_VALUES
+			sorted[count].spill = bulk_new;
+#endif
+			++count;
+		}
+
+		// lsd radix sort on the home slot, 11 bits a pass. it's stable so the old entries stay in front of the new ones
+		int home_bits = 0;
+		while ((1ull << home_bits) < new_capacity) ++home_bits;
+		for (int shift = 0; shift < home_bits; shift += 11) {
+			uint64_t offsets[2048];
+			memset(offsets, 0, sizeof(offsets));
+			for (uint64_t i = 0; i < count; i++) ++offsets[((sorted[i].hash & new_mask) >> shift) & 2047];
+			uint64_t sum = 0;
+			for (int d = 0; d < 2048; d++) {
+				uint64_t c = offsets[d];
+				offsets[d] = sum;
+				sum += c;
+			}
+			for (uint64_t i = 0; i < count; i++) scratch[offsets[((sorted[i].hash & new_mask) >> shift) & 2047]++] = sorted[i];
+			Bucket *tmp = sorted; sorted = scratch; scratch = tmp;
+		}
+
+		// equal keys have equal homes, so duplicates are within a run of the same home (which is short)
+		uint64_t kept = 0;
+		for (uint64_t run = 0; run < count;) {
+			uint64_t end = run + 1;
+			while (end < count && (sorted[end].hash & new_mask) == (sorted[run].hash & new_mask)) ++end;
+#ifdef HT_MULTIPLE_VALUES
+			// the values of a key have to be next to each other, keep them in the order they came in
+			for (uint64_t i = run; i < end; i++) {
+				if (sorted[i].hash == HT_EMPTY) continue;
+				Bucket key_bucket = sorted[i];
+#ifdef HT_INLINE_VALUES
+				// the key's buckets from the table come first (the sort is stable) and the first of them has the handle.
+				// new values go to the spill block once there is one or the table part is full, same as insert
+				uint64_t key_first = kept;
+				uint32_t handle = 0;
+				uint64_t in_table = 0;
+#endif
+				for (uint64_t j = i; j < end; j++) {
+					if (sorted[j].hash != HT_EMPTY && equal(key_bucket.hash, sorted[j].hash, key_bucket.key, sorted[j].key)) {
+#ifdef HT_INLINE_VALUES
+						if (sorted[j].spill != bulk_new) {
+							if (sorted[j].spill) handle = sorted[j].spill;
+						} else if (handle || in_table >= HT_INLINE_VALUES) {
+							spill_append(&handle, sorted[j].value);
+							sorted[j].hash = HT_EMPTY;
+							continue;
+						} else {
+							sorted[j].spill = 0;
+						}
+						++in_table;
+#endif
+						scratch[kept++] = sorted[j];
+						sorted[j].hash = HT_EMPTY;
+					}
+				}
+#ifdef HT_INLINE_VALUES
+				scratch[key_first].spill = handle;
+#endif
+			}
+#else
+			for (uint64_t i = run; i < end; i++) {
+				bool overwritten = false;
+				for (uint64_t j = i + 1; j < end && !overwritten; j++) {
+					overwritten = equal(sorted[i].hash, sorted[j].hash, sorted[i].key, sorted[j].key);
+				}
+				if (!overwritten) scratch[kept++] = sorted[i];
+			}
+#endif
+			run = end;
+		}
+		_free(sorted, total * sizeof(Bucket));
+		sorted = scratch;
+
+		// Every entry goes to max(its home, the slot after the previous one). What runs past the end wraps around to the front,
+		// so the front has to start that many slots in, which can push a little more past the end. Repeat until it settles.
+		uint64_t start = 0;
+		for (;;) {
+			uint64_t cursor = start;
+			for (uint64_t i = 0; i < kept; i++) cursor = dh_ht_max(cursor, sorted[i].hash & new_mask) + 1;
+			uint64_t overflow = cursor > new_capacity ? cursor - new_capacity : 0;
+			if (overflow <= start) break;
+			start = overflow;
+		}
+
+#ifdef HT_ALLOCATOR
+		HT_TABLE new_ht(allocator, (Size)new_capacity);
+#else
+		HT_TABLE new_ht((Size)new_capacity);
+#endif
+		uint64_t cursor = start;
+		for (uint64_t i = 0; i < kept; i++) {
+			cursor = dh_ht_max(cursor, sorted[i].hash & new_mask);
+			new_ht.write_bucket(cursor & new_mask, sorted[i]);
+			++cursor;
+		}
+		new_ht.length = kept;
+		_free(sorted, total * sizeof(Bucket));
+		take_storage(&new_ht);
+#ifdef HT_STRING_KEYS
+		compact_arena(0);
+#endif
+#ifdef HT_COMPACT
+		if (overflowed) resizeTo(capacity * 2);
+#endif
+		HT_WRITE_END
+	}
+
+#ifndef HT_VALUE
+	// Set algebra for hashsets. The other table and out are tables of the same type, out can't be one of the inputs and the results
+	// are added to whatever is in it already. If both inputs hash the same way and have the same capacity the entries of a home slot
+	// are in the same place in both, so both tables are walked side by side in slot order. Otherwise every entry of one of them is
+	// looked up in the other in prefetched batches like lookup_batch (the smaller one is looked up where the order doesn't matter).
+	uint64_t intersection_count(HT_TABLE *other) {
+		if (!walks_in_step(other) && other->length < length) return other->intersection_count(this);
+		uint64_t count = 0;
+		membership(other, [&](const Bucket &, bool found) { count += found; });
+		return count;
+	}
+
+	void intersect_into(HT_TABLE *other, HT_TABLE *out) {
+		if (!walks_in_step(other) && other->length < length) return other->intersect_into(this, out);
+		membership(other, [&](const Bucket &bucket, bool found) { if (found) add_to(out, bucket); });
+	}
+
+	// everything in this that isn't in other
+	void difference_into(HT_TABLE *other, HT_TABLE *out) {
+		membership(other, [&](const Bucket &bucket, bool found) { if (!found) add_to(out, bucket); });
+	}
+
+	void union_into(HT_TABLE *other, HT_TABLE *out) {
+		uint64_t total = out->length + length + other->length;
+		uint64_t new_capacity = out->capacity;
+		while (total >= (uint64_t)(new_capacity * HT_GROW_FACTOR)) new_capacity *= 2;
+		if (new_capacity != out->capacity) out->resizeTo((Size)new_capacity);
+		Iterator it = range(0, 1);
+		Bucket bucket;
+		while (it.next(&bucket)) add_to(out, portable(bucket));
+		other->membership(this, [&](const Bucket &bucket, bool found) { if (!found) add_to(out, bucket); });
+	}
+
+	bool same_hashing(HT_TABLE *other) {
+#ifdef HT_SEED
+		return seed == other->seed;
+#else
+		(void)other;
+		return true;
+#endif
+	}
+
+	bool walks_in_step(HT_TABLE *other) {
+#ifdef HT_INCREMENTAL_RESIZE
+		if (old || other->old) return false;
+#endif
+		return capacity == other->capacity && same_hashing(other);
+	}
+
+	// the bucket as something another table can make sense of (only string keys in our arena need that)
+	Bucket portable(Bucket bucket) {
+#ifdef HT_STRING_KEYS
+		if (bucket.key.length & DH_HT_STR_IN_ARENA) {
+			bucket.key.length &= ~DH_HT_STR_IN_ARENA;
+			bucket.key.ptr = arena + bucket.key.offset;
+		}
+#endif
+		return bucket;
+	}
+
+	void add_to(HT_TABLE *out, Bucket bucket) {
+		if (!same_hashing(out)) bucket.hash = out->hash_key(bucket.key);
+		out->insert(bucket);
+	}
+
+	// fn(bucket, found) for every entry of ours (made portable) in slot order, found says if other has it too
+	template <typename Fn>
+	void membership(HT_TABLE *other, Fn fn) {
+		if (length == 0) return;
+		if (walks_in_step(other)) {
+			// the entries of a home slot are together and the homes only go up from the first slot that didn't wrap around, in both tables.
+			// a and b run past capacity at the end to get to the ones that did
+			uint64_t a = 0, b = 0;
+			while (hash_at(a) != HT_EMPTY && probe_count(a) > a) ++a;
+			while (other->hash_at(b) != HT_EMPTY && other->probe_count(b) > b) ++b;
+			for (uint64_t home = 0; home < capacity; home++) {
+				a = dh_ht_max(a, home);
+				b = dh_ht_max(b, home);
+				uint64_t group = b;
+				while (other->hash_at(mask(b)) != HT_EMPTY && mask(other->hash_at(mask(b))) == home) ++b;
+				for (; hash_at(mask(a)) != HT_EMPTY && mask(hash_at(mask(a))) == home; ++a) {
+					Bucket bucket = portable(bucket_at(mask(a)));
+					bool found = false;
+					for (uint64_t i = group; i < b && !found; i++) {
+						found = equal(bucket.hash, other->hash_at(mask(i)), bucket.key, other->portable(other->bucket_at(mask(i))).key);
+					}
+					fn((const Bucket &)bucket, found);
+				}
+			}
+			return;
+		}
+		bool rehash = !same_hashing(other);
+		Bucket batch[2][HT_BATCH_SIZE];
+		Hash hashes[2][HT_BATCH_SIZE];
+		uint64_t counts[2] = { 0, 0 };
+		Iterator it = range(0, 1);
+		for (int group = 0;; group ^= 1) {
+			// fill and prefetch this group while resolving the one before it
+			counts[group] = 0;
+			while (counts[group] < HT_BATCH_SIZE && it.next(&batch[group][counts[group]])) {
+				Bucket *bucket = &batch[group][counts[group]++];
+				*bucket = portable(*bucket);
+				hashes[group][counts[group] - 1] = rehash ? other->hash_key(bucket->key) : bucket->hash;
+				other->prefetch_slot(other->mask(hashes[group][counts[group] - 1]));
+			}
+			for (uint64_t i = 0; i < counts[group ^ 1]; i++) {
+				uint64_t index;
+				fn((const Bucket &)batch[group ^ 1][i], other->ilookup_hashed(hashes[group ^ 1][i], batch[group ^ 1][i].key, &index));
+			}
+			if (counts[group] == 0) break;
+		}
+	}
+#endif
+
+	// throws away whatever is in the table and builds it from entries, see insert_bulk
+	void build_from(const Bucket *entries, uint64_t n) {
+		HT_WRITE_BEGIN
+		clear();
+		insert_bulk(entries, n);
+		HT_WRITE_END
+	}
+
+	void destroy() {
+#ifdef HT_INCREMENTAL_RESIZE
+		release_old();
+#endif
+		free_storage();
+		this->capacity = 0;
+		this->length = 0;
+#ifdef HT_INLINE_VALUES
+		spill_release_all();
+#endif
+#ifdef HT_STRING_KEYS
+		if (arena) _free(arena, arena_capacity);
+		arena = 0;
+		arena_length = arena_capacity = 0;
+#endif
+#ifdef HT_OPTIMISTIC_READERS
+		// there mustn't be any readers left at this point
+		for (int i = 0; i < num_retired; i++) _free(retired[i].storage, retired[i].num_bytes);
+		if (retired) _free(retired, max_retired * sizeof(Retired));
+		retired = 0;
+		num_retired = max_retired = 0;
+#endif
+	}
+
+	void clear() {
+		HT_WRITE_BEGIN
+#ifdef HT_INCREMENTAL_RESIZE
+		release_old();
+#endif
+		length = 0;
+		memset(storage_base(), 0, storage_bytes(capacity));
+#ifdef HT_INLINE_VALUES
+		spill_release_all();
+#endif
+#ifdef HT_STRING_KEYS
+		arena_length = 0;
+#endif
+		HT_WRITE_END
+	}
+
+	void clear_and_shrink() {
+		HT_WRITE_BEGIN
+#ifdef HT_INCREMENTAL_RESIZE
+		release_old();
+#endif
+		free_storage();
+		alloc_storage(min_size);
+		length = 0;
+#ifdef HT_INLINE_VALUES
+		spill_release_all();
+#endif
+#ifdef HT_STRING_KEYS
+		compact_arena(0);
+#endif
+		HT_WRITE_END
+	}
+
+	// moves the entries in [begin, end) to new_ht which has twice our capacity, keeping them in order.
+	// with HT_COMPACT *overflow is set instead of new_ht->overflowed, every thread has its own.
+	void split_into(HT_TABLE *new_ht, uint64_t begin, uint64_t end, bool *overflow) {
+		uint64_t low = 0;
+		uint64_t high = capacity;
+		for (uint64_t i = begin; i < end; i++) {
+			if (hash_at(i) == HT_EMPTY) continue;
+			Bucket bucket = bucket_at(i); // with HT_COMPACT that's where the bit we split by comes from
+			if (bucket.hash & capacity) { // do we go to high or low half of the new hashtable
+				high = dh_ht_max(high, new_ht->mask(bucket.hash));
+#ifdef HT_COMPACT
+				new_ht->write_bucket(high++, bucket, overflow);
+#else
+				new_ht->write_bucket(high++, bucket);
+#endif
+			} else {
+				low = dh_ht_max(low, new_ht->mask(bucket.hash));
+#ifdef HT_COMPACT
+				new_ht->write_bucket(low++, bucket, overflow);
+#else
+				new_ht->write_bucket(low++, bucket);
+#endif
+			}
+		}
+		(void)overflow;
+	}
+
+	void double_capacity() {
+		HT_WRITE_BEGIN
+		HT_STAT(double resize_start = stats_now();)
+#ifdef HT_INCREMENTAL_RESIZE
+		finish_resize();
+#endif
+#ifdef HT_ALLOCATOR
+		HT_TABLE new_ht(allocator, capacity * 2);
+#else
+		HT_TABLE new_ht(capacity * 2);
+#endif
+		new_ht.min_size = min_size;
+		int old_len = length;
+		// find the first bucket that hasn't wrapped around
+		uint64_t fst;
+		for (fst = 0; hash_at(fst) != HT_EMPTY && mask(hash_at(fst)) > fst; ++fst);
+		length -= fst;
+		new_ht.length = length;
+		bool overflow = false;
+
+#ifdef HT_PARALLEL_RESIZE
+		uint64_t num_threads = dh_ht_min((uint64_t)HT_PARALLEL_RESIZE, (capacity - fst) / HT_PARALLEL_RESIZE_MIN);
+		if (num_threads > 1) {
+			// segments start at an empty slot so no cluster is cut in two. Then every entry of a segment lands at or before
+			// its old slot (plus capacity in the high half) and at or after the segment start, so the segments never write
+			// into each other and need no locking. Only the wrapped around entries are left over for afterwards.
+			uint64_t starts[HT_PARALLEL_RESIZE + 1];
+			starts[0] = fst;
+			for (uint64_t t = 1; t < num_threads; t++) {
+				uint64_t i = dh_ht_max(starts[t - 1], fst + (capacity - fst) * t / num_threads);
+				while (i < capacity && hash_at(i) != HT_EMPTY) ++i;
+				starts[t] = i;
+			}
+			starts[num_threads] = capacity;
+			std::thread workers[HT_PARALLEL_RESIZE];
+			bool overflows[HT_PARALLEL_RESIZE] = {};
+			for (uint64_t t = 1; t < num_threads; t++) {
+				workers[t] = std::thread([this, &new_ht, &starts, &overflows, t]() { split_into(&new_ht, starts[t], starts[t + 1], &overflows[t]); });
+			}
+			split_into(&new_ht, starts[0], starts[1], &overflow);
+			for (uint64_t t = 1; t < num_threads; t++) {
+				workers[t].join();
+				overflow |= overflows[t];
+			}
+		} else
+#endif
+		split_into(&new_ht, fst, capacity, &overflow);
+#ifdef HT_COMPACT
+		new_ht.overflowed = overflow;
+#endif
+
+		for (uint64_t i = 0; i < fst; i++) {
+			new_ht.move_in(bucket_at(i));
+			++new_ht.length;
+		}
+
+		take_storage(&new_ht);
+#ifdef HT_STRING_KEYS
+		compact_arena(0);
+#endif
+		HT_STAT(++stats.resizes; stats.resize_seconds += stats_now() - resize_start;)
+		HT_WRITE_END
+	}
+
+#ifdef HT_STATS
+	static double stats_now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static void stats_count(uint64_t *histogram, uint64_t n) {
+		++histogram[n < HT_STATS_HISTOGRAM - 1 ? n : HT_STATS_HISTOGRAM - 1];
+	}
+
+	Stats get_stats() {
+		Stats result = stats;
+		uint64_t total = 0;
+		result.max_displacement = 0;
+		for (uint64_t i = 0; i < capacity; i++) {
+			if (hash_at(i) == HT_EMPTY) continue;
+			uint64_t displacement = probe_count(i);
+			total += displacement;
+			result.max_displacement = dh_ht_max(result.max_displacement, displacement);
+		}
+#ifdef HT_INCREMENTAL_RESIZE
+		if (old) {
+			for (uint64_t i = 0; i < old->capacity; i++) {
+				if (old->hash_at(i) == HT_EMPTY) continue;
+				uint64_t displacement = old->probe_count(i);
+				total += displacement;
+				result.max_displacement = dh_ht_max(result.max_displacement, displacement);
+			}
+		}
+#endif
+		result.avg_displacement = length ? (double)total / length : 0;
+		return result;
+	}
+
+	void reset_stats() {
+		memset(&stats, 0, sizeof(stats));
+	}
+#endif
+
+#ifdef HT_OPTIMISTIC_READERS
+	// The writer side of the seqlock. Nested calls (insert -> double_capacity etc.) only bump the version once.
+	void write_begin() {
+		if (write_depth++ == 0) {
+			// RMW + fence so the slot writes below can't be seen before the odd version (a relaxed store doesn't order them)
+			version.fetch_add(1, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+	}
+
+	void write_end() {
+		if (--write_depth == 0) {
+			version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+	}
+
+	// only call this inside HT_WRITE_BEGIN/END, after storage no longer points at these slots. A reader that picked up
+	// the old pointer fails its version check, and one that shows up in a later epoch only ever sees the new slots.
+	void retire(void *storage, size_t num_bytes) {
+		if (num_retired == max_retired) {
+			int new_max = max_retired ? max_retired * 2 : 8;
+			Retired *new_retired = (Retired *)_alloc(new_max * sizeof(Retired));
+			if (retired) {
+				memcpy(new_retired, retired, num_retired * sizeof(Retired));
+				_free(retired, max_retired * sizeof(Retired));
+			}
+			retired = new_retired;
+			max_retired = new_max;
+		}
+		Retired r = { storage, num_bytes, epoch.load(std::memory_order_relaxed) };
+		retired[num_retired++] = r;
+		epoch.fetch_add(1, std::memory_order_seq_cst);
+		reclaim();
+	}
+
+	// frees whatever no reader can be looking at anymore. Called on every retire, call it yourself if you want memory back sooner.
+	void reclaim() {
+		uint64_t oldest = UINT64_MAX;
+		for (int i = 0; i < HT_OPTIMISTIC_READERS; i++) {
+			uint64_t e = readers[i].epoch.load(std::memory_order_seq_cst);
+			if (e && e < oldest) oldest = e;
+		}
+		int kept = 0;
+		for (int i = 0; i < num_retired; i++) {
+			if (retired[i].retire_epoch < oldest) _free(retired[i].storage, retired[i].num_bytes);
+			else retired[kept++] = retired[i];
+		}
+		num_retired = kept;
+	}
+
+	// Safe to call from reader threads while the writer is working. The storage pointer and capacity are validated
+	// against the version before they're used, and the probe works on its own copies so a torn bucket is just a retry.
+#ifdef HT_VALUE
+	bool lookup_optimistic(int reader_id, HT_KEY key, HT_VALUE *value) {
+#else
+	bool lookup_optimistic(int reader_id, HT_KEY key) {
+#endif
+		Hash hash = hash_key(key);
+		readers[reader_id].epoch.store(epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool found;
+		for (;;) {
+			uint64_t v = version.load(std::memory_order_acquire);
+			if (v & 1) continue;
+			Bucket *b = buckets;
+			uint64_t cap = capacity;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (version.load(std::memory_order_relaxed) != v) continue;
+
+			found = false;
+			uint64_t idx = hash & (cap - 1);
+			for (uint64_t dist = 0; dist < cap; dist++) {
+				Bucket bucket = b[idx];
+				if (bucket.hash == HT_EMPTY) break;
+				if (equal(bucket.hash, hash, bucket.key, key)) {
+#ifdef HT_VALUE
+					*value = bucket.value;
+#endif
+					found = true;
+					break;
+				}
+				if (dist > ((idx - bucket.hash) & (cap - 1))) break;
+				idx = (idx + 1) & (cap - 1);
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (version.load(std::memory_order_relaxed) == v) break;
+		}
+		readers[reader_id].epoch.store(0, std::memory_order_release);
+		return found;
+	}
+#endif
+
+#ifdef HT_SNAPSHOT
+	// the file is the header, padding up to HT_SNAPSHOT_DATA_OFFSET and then storage_bytes(capacity) bytes of slots.
+	// the data starts on a page so the mapped arrays end up with the same alignment as allocated ones.
+	struct SnapshotHeader {
+		uint64_t magic;
+		uint64_t capacity;
+		uint64_t length;
+		uint64_t layout;    // sizeof(Bucket) and the layout defines, a file only maps into the same kind of table
+		uint64_t data_bytes;
+		uint64_t hash_id;
+		uint64_t checksum;  // of the data_bytes after the header
+		uint64_t seed;      // the stored hashes were made with it, so the table has to keep using it
 	};
 
+	static uint64_t snapshot_layout() {
+		uint64_t layout = sizeof(Bucket);
+#ifdef HT_SOA
+		layout |= 1ull << 32;
+#endif
+#ifdef HT_SIMD_PROBE
+		layout |= (uint64_t)HT_GROUP << 40;
+#endif
+#ifdef HT_MULTIPLE_VALUES
+		layout |= 1ull << 48;
+#endif
+#ifdef HT_SEED
+		layout |= 1ull << 49;
+#endif
+#ifdef HT_LARGE
+		layout |= 1ull << 50;
+#endif
+		return layout;
+	}
+
+	static uint64_t snapshot_hash_id() {
+		return HT_HASH_ID;
+	}
+
+	static bool write_all(int fd, const void *data, size_t num_bytes) {
+		const char *at = (const char *)data;
+		while (num_bytes) {
+			ssize_t written = write(fd, at, num_bytes);
+			if (written <= 0) return false;
+			at += written;
+			num_bytes -= written;
+		}
+		return true;
+	}
+
+	// writes the table at the current position of fd, returns false if a write failed
+	bool save(int fd) {
+#ifdef HT_INCREMENTAL_RESIZE
+		finish_resize();
+#endif
+		SnapshotHeader header;
+		memset(&header, 0, sizeof(header));
+		header.magic = HT_SNAPSHOT_MAGIC;
+		header.capacity = capacity;
+		header.length = length;
+		header.layout = snapshot_layout();
+		header.data_bytes = storage_bytes(capacity);
+		header.hash_id = snapshot_hash_id();
+		header.checksum = dh_ht_checksum(storage_base(), header.data_bytes);
+#ifdef HT_SEED
+		header.seed = seed;
+#endif
+
+		char page[HT_SNAPSHOT_DATA_OFFSET];
+		memset(page, 0, sizeof(page));
+		memcpy(page, &header, sizeof(header));
+		return write_all(fd, page, sizeof(page)) && write_all(fd, storage_base(), header.data_bytes);
+	}
+
+	// Replaces the contents of the table with the mapped file. Returns false (and leaves the table alone) if the file can't be
+	// mapped or doesn't match this kind of table. verify_checksum reads the whole file, which is what you're trying to avoid, but it's there.
+	bool map_readonly(const char *path, bool verify_checksum = false) {
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t)st.st_size < HT_SNAPSHOT_DATA_OFFSET) {
+			close(fd);
+			return false;
+		}
+		void *mapping = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) return false;
+
+		SnapshotHeader header;
+		memcpy(&header, mapping, sizeof(header));
+		char *data = (char *)mapping + HT_SNAPSHOT_DATA_OFFSET;
+		bool ok = header.magic == HT_SNAPSHOT_MAGIC
+			&& header.layout == snapshot_layout()
+			&& header.hash_id == snapshot_hash_id()
+			&& header.capacity && !(header.capacity & (header.capacity - 1)) && (Size)header.capacity == header.capacity
+			&& header.data_bytes == storage_bytes(header.capacity)
+			&& (uint64_t)st.st_size >= HT_SNAPSHOT_DATA_OFFSET + header.data_bytes
+			&& (!verify_checksum || dh_ht_checksum(data, header.data_bytes) == header.checksum);
+		if (!ok) {
+			munmap(mapping, st.st_size);
+			return false;
+		}
+
+		destroy();
+		set_storage(data, header.capacity);
+		length = header.length;
+		min_size = (Size)header.capacity;
+		mapped_bytes = st.st_size;
+#ifdef HT_SEED
+		seed = header.seed;
+#endif
+		return true;
+	}
+#endif
+
+	struct Iterator {
+		uint64_t idx;
+		HT_TABLE *ht;
+#ifdef HT_INLINE_VALUES
+		// the spilled values of a key come after the last of its buckets. spill is nonzero while we're going through them
+		uint32_t spill;
+		uint32_t spill_pos;
+		uint64_t spill_first;
+#endif
+		// one past the last index this goes through, 0 for all of them (so { 0, &table } still works)
+		uint64_t end;
+		// remove doesn't shrink the table, that would move everything around under us. If we removed anything the table is
+		// shrunk once when next runs out, unless this is only a range (the other ranges would be lost).
+		bool removed;
+
+		bool finished() {
+			if (removed && !end) ht->shrink_to_fit();
+			removed = false;
+			return false;
+		}
+
+		bool next(Bucket *bucket) {
+#ifdef HT_INLINE_VALUES
+			if (spill) {
+				if (spill_pos < ht->spill_blocks[spill - 1].count) {
+					*bucket = ht->bucket_at(spill_first);
+					bucket->value = ht->spill_blocks[spill - 1].values[spill_pos++];
+					return true;
+				}
+				spill = 0;
+			}
+#endif
+			uint64_t stop = end ? end : ht->iteration_end();
+			uint64_t in_table = dh_ht_min(stop, (uint64_t)ht->capacity);
+			while (idx < in_table) {
+				if (ht->hash_at(idx) != HT_EMPTY) {
+					*bucket = ht->bucket_at(idx);
+					++idx;
+#ifdef HT_INLINE_VALUES
+					// a key that runs past the end of our range still gets its spilled values from whichever range has its last bucket
+					uint64_t next = ht->mask(idx);
+					if (ht->hash_at(next) != bucket->hash || !ht->equal(ht->key_at(next), bucket->key)) {
+						spill_first = ht->run_start(idx - 1);
+						spill = ht->spill_at(spill_first);
+						spill_pos = 0;
+					}
+#endif
+					return true;
+				}
+				++idx;
+			}
+#ifdef HT_INCREMENTAL_RESIZE
+			// while growing, indices past our capacity are the slots of old
+			while (ht->old && idx < stop && idx - ht->capacity < ht->old->capacity) {
+				if (ht->old->hash_at(idx - ht->capacity) != HT_EMPTY) {
+					*bucket = ht->old->bucket_at(idx - ht->capacity);
+					++idx;
+					return true;
+				}
+				++idx;
+			}
+#endif
+			return finished();
+		}
+
+		void remove() {
+			removed = true;
+#ifdef HT_INCREMENTAL_RESIZE
+			if (idx > ht->capacity) {
+				uint64_t old_idx = --idx - ht->capacity;
+				ht->old->remove_at(old_idx);
+				--ht->length;
+				if (ht->old->hash_at(old_idx) == HT_EMPTY)++idx;
+				return;
+			}
+#endif
+#ifdef HT_INLINE_VALUES
+			if (spill && spill_pos > 0) {
+				ht->remove_spilled(spill_first, --spill_pos);
+				spill = ht->spill_at(spill_first);
+				return;
+			}
+			--idx;
+			// refilled means we'll be back at this key, so don't go through its spilled values yet
+			if (ht->remove_inline_value(ht->run_start(idx), idx, false)) spill = 0;
+#else
+			ht->remove_at(--idx, false);
+#endif
+			if (ht->hash_at(idx) == HT_EMPTY)++idx;
+		}
+	};
+
+
+	// the indices an Iterator goes through, with HT_INCREMENTAL_RESIZE the slots of old come after ours
+	uint64_t iteration_end() {
+#ifdef HT_INCREMENTAL_RESIZE
+		if (old) return capacity + old->capacity;
+#endif
+		return capacity;
+	}
+
+	// an Iterator over part (0 to num_parts - 1) of the slots. The parts don't overlap and together they have every entry once,
+	// so they can be gone through by different threads at the same time. Don't remove through them while others are running.
+	Iterator range(uint64_t part, uint64_t num_parts) {
+		Iterator it;
+		memset(&it, 0, sizeof(it));
+		it.ht = this;
+		it.idx = iteration_end() * part / num_parts;
+		it.end = iteration_end() * (part + 1) / num_parts;
+		// end == 0 would mean the whole table
+		if (it.idx == it.end) it.idx = it.end = ~0ull;
+		return it;
+	}
+
+#ifdef HT_PARALLEL_ITERATION
+	// fn(const Bucket &) for every entry, from num_threads threads at once (the calling thread is one of them). fn has to be fine
+	// with that, and the table must not change until this returns.
+	template <typename Fn>
+	void parallel_for_each(Fn fn, int num_threads) {
+		if (num_threads < 1) num_threads = 1;
+		auto scan = [&](int part) {
+			Iterator it = range(part, num_threads);
+			Bucket bucket;
+			while (it.next(&bucket)) fn((const Bucket &)bucket);
+		};
+		std::thread *workers = new std::thread[num_threads - 1];
+		for (int i = 1; i < num_threads; i++) workers[i - 1] = std::thread(scan, i);
+		scan(0);
+		for (int i = 1; i < num_threads; i++) workers[i - 1].join();
+		delete[] workers;
+	}
+#endif
 
 #undef HT_EMPTY
 };
+
+#ifdef HT_CONCURRENT_SHARDS
+struct HT_NAME {
+	typedef HT_TABLE::Bucket Bucket;
+
+	struct HT_ALIGN_CACHE_LINE Shard {
+		std::mutex lock;
+		HT_TABLE table;
+	};
+	Shard shards[HT_CONCURRENT_SHARDS];
+
+	HT_NAME() {
+		share_seed();
+	}
+
+	// capacity is the total, split evenly over the shards
+	HT_NAME(HT_TABLE::Size capacity) {
+		HT_TABLE::Size per_shard = capacity / HT_CONCURRENT_SHARDS;
+		if (per_shard < 2) per_shard = 2;
+		for (int i = 0; i < HT_CONCURRENT_SHARDS; i++) {
+			shards[i].table.destroy();
+			new (&shards[i].table) HT_TABLE(per_shard);
+		}
+		share_seed();
+	}
+
+	// the shard is picked from the hash, so all of them have to hash the same way
+	void share_seed() {
+#ifdef HT_SEED
+		for (int i = 1; i < HT_CONCURRENT_SHARDS; i++) shards[i].table.seed = shards[0].table.seed;
+#endif
+	}
+
+	static int shard_shift() {
+		int bits = 0;
+		while ((1 << bits) < HT_CONCURRENT_SHARDS) ++bits;
+		return (int)sizeof(HT_TABLE::Hash) * 8 - bits;
+	}
+
+	// the tables index with the low bits, so use the high ones here or every shard would only use a fraction of its slots
+	inline Shard *shard_of(HT_TABLE::Hash hash) {
+#if HT_CONCURRENT_SHARDS == 1
+		return &shards[0];
+#else
+		return &shards[hash >> shard_shift()];
+#endif
+	}
+
+#ifdef HT_VALUE
+	void insert(HT_KEY key, HT_VALUE value) {
+		Bucket to_insert = { key, value, shards[0].table.hash_key(key) };
+#else
+	void insert(HT_KEY key) {
+		Bucket to_insert = { key, shards[0].table.hash_key(key) };
+#endif
+		Shard *shard = shard_of(to_insert.hash);
+		std::lock_guard<std::mutex> guard(shard->lock);
+		shard->table.insert(to_insert);
+	}
+
+#ifdef HT_VALUE
+	bool lookup(HT_KEY key, HT_VALUE *value) {
+#else
+	bool lookup(HT_KEY key) {
+#endif
+		HT_TABLE::Hash hash = shards[0].table.hash_key(key);
+		Shard *shard = shard_of(hash);
+		std::lock_guard<std::mutex> guard(shard->lock);
+		uint64_t index;
+		if (!shard->table.ilookup_hashed(hash, key, &index)) return false;
+#ifdef HT_VALUE
+		*value = shard->table.value_at(index);
+#endif
+		return true;
+	}
+
+	bool remove(HT_KEY key) {
+		HT_TABLE::Hash hash = shards[0].table.hash_key(key);
+		Shard *shard = shard_of(hash);
+		std::lock_guard<std::mutex> guard(shard->lock);
+		uint64_t index;
+		if (!shard->table.ilookup_hashed(hash, key, &index)) return false;
+		shard->table.remove_at(index);
+		return true;
+	}
+
+	// for lookup_hashed, all the shards hash the same way
+	HT_TABLE::Hash hash_key(HT_KEY key) { return shards[0].table.hash_key(key); }
+	HT_TABLE::Hash finish_hash(uint64_t raw) { return shards[0].table.finish_hash(raw); }
+
+#ifdef HT_VALUE
+	bool lookup_hashed(HT_TABLE::Hash hash, HT_TABLE::LookupKey key, HT_VALUE *value) {
+		Shard *shard = shard_of(hash);
+		std::lock_guard<std::mutex> guard(shard->lock);
+		return shard->table.lookup_hashed(hash, key, value);
+	}
+
+	// fn runs with the shard locked, so the read-modify-write is atomic. There's no find_or_insert here, the pointer
+	// would outlive the lock.
+	template <typename Fn>
+	bool update(HT_KEY key, Fn fn) {
+		HT_TABLE::Hash hash = shards[0].table.hash_key(key);
+		Shard *shard = shard_of(hash);
+		std::lock_guard<std::mutex> guard(shard->lock);
+		return shard->table.update_hashed(hash, key, fn);
+	}
+#else
+	bool lookup_hashed(HT_TABLE::Hash hash, HT_TABLE::LookupKey key) {
+		Shard *shard = shard_of(hash);
+		std::lock_guard<std::mutex> guard(shard->lock);
+		return shard->table.lookup_hashed(hash, key);
+	}
+#endif
+
+#ifdef HT_PARALLEL_ITERATION
+	// the shards are handed out to the threads in turn, each one is locked while it's gone through
+	template <typename Fn>
+	void parallel_for_each(Fn fn, int num_threads) {
+		if (num_threads < 1) num_threads = 1;
+		if (num_threads > HT_CONCURRENT_SHARDS) num_threads = HT_CONCURRENT_SHARDS;
+		auto scan = [&](int first) {
+			for (int i = first; i < HT_CONCURRENT_SHARDS; i += num_threads) {
+				std::lock_guard<std::mutex> guard(shards[i].lock);
+				HT_TABLE::Iterator it = shards[i].table.range(0, 1);
+				Bucket bucket;
+				while (it.next(&bucket)) fn((const Bucket &)bucket);
+			}
+		};
+		std::thread *workers = new std::thread[num_threads - 1];
+		for (int i = 1; i < num_threads; i++) workers[i - 1] = std::thread(scan, i);
+		scan(0);
+		for (int i = 1; i < num_threads; i++) workers[i - 1].join();
+		delete[] workers;
+	}
+#endif
+
+	// one shard at a time, each one is locked while it's swept
+	template <typename Keep>
+	uint64_t retain(Keep keep) {
+		uint64_t removed = 0;
+		for (int i = 0; i < HT_CONCURRENT_SHARDS; i++) {
+			std::lock_guard<std::mutex> guard(shards[i].lock);
+			removed += shards[i].table.retain(keep);
+		}
+		return removed;
+	}
+
+	template <typename Remove>
+	uint64_t erase_if(Remove remove) {
+		return retain([&](const Bucket &bucket) { return !remove(bucket); });
+	}
+
+#ifdef HT_STATS
+	typedef HT_TABLE::Stats Stats;
+
+	// summed over the shards (max_displacement is the largest one), takes every lock in turn
+	Stats get_stats() {
+		Stats total;
+		memset(&total, 0, sizeof(total));
+		uint64_t entries = 0;
+		double displacement = 0;
+		for (int i = 0; i < HT_CONCURRENT_SHARDS; i++) {
+			std::lock_guard<std::mutex> guard(shards[i].lock);
+			Stats shard = shards[i].table.get_stats();
+			for (int b = 0; b < HT_STATS_HISTOGRAM; b++) {
+				total.hit_probes[b] += shard.hit_probes[b];
+				total.miss_probes[b] += shard.miss_probes[b];
+				total.shift_lengths[b] += shard.shift_lengths[b];
+			}
+			total.inserts += shard.inserts;
+			total.insert_swaps += shard.insert_swaps;
+			total.removes += shard.removes;
+			total.resizes += shard.resizes;
+			total.resize_seconds += shard.resize_seconds;
+			total.max_displacement = dh_ht_max(total.max_displacement, shard.max_displacement);
+			displacement += shard.avg_displacement * shards[i].table.length;
+			entries += shards[i].table.length;
+		}
+		total.avg_displacement = entries ? displacement / entries : 0;
+		return total;
+	}
+#endif
+
+	// only a snapshot if there are writers running
+	uint64_t count() {
+		uint64_t total = 0;
+		for (int i = 0; i < HT_CONCURRENT_SHARDS; i++) {
+			std::lock_guard<std::mutex> guard(shards[i].lock);
+			total += shards[i].table.length;
+		}
+		return total;
+	}
+
+	// not thread safe, nothing else may touch the table
+	void destroy() {
+		for (int i = 0; i < HT_CONCURRENT_SHARDS; i++) {
+			shards[i].table.destroy();
+		}
+	}
+};
+#endif
 #endif
 
 #undef HT_ERROR
@@ -516,10 +3095,40 @@ bool lookup(HT_KEY key, ValueIterator *it) {
 #undef HT_EQUAL
 #undef HT_GROW_FACTOR
 #undef HT_SHRINK_FACTOR
-#undef HT_SWAP
 #undef HT_FAST_KEY_CMP
 #undef HT_MULTIPLE_VALUES
 #undef HT_MULTIPLE_VALUES_ORDERED
-
-
-
+#undef HT_SIMD_PROBE
+#undef HT_SOA
+#undef HT_BATCH_SIZE
+#undef HT_INCREMENTAL_RESIZE
+#undef HT_MIGRATE_STEP
+#undef HT_CONCURRENT_SHARDS
+#undef HT_TABLE
+#undef HT_OPTIMISTIC_READERS
+#undef HT_WRITE_BEGIN
+#undef HT_WRITE_END
+#undef HT_ALIGN_CACHE_LINE
+#undef HT_CONCAT
+#undef HT_CONCAT2
+#undef HT_GROUP
+#undef HT_SNAPSHOT
+#undef HT_SNAPSHOT_DATA_OFFSET
+#undef HT_SNAPSHOT_MAGIC
+#undef HT_HASH_ID
+#undef HT_STR
+#undef HT_STR2
+#undef HT_SEED
+#undef HT_INLINE_VALUES
+#undef HT_STATS
+#undef HT_STAT
+#undef HT_STATS_HISTOGRAM
+#undef HT_PARALLEL_RESIZE
+#undef HT_PARALLEL_RESIZE_MIN
+#undef HT_PARALLEL_ITERATION
+#undef HT_COMPACT
+#undef HT_LARGE
+#undef HT_ALLOC_ZEROED
+#undef HT_STRING_KEYS
+#undef HT_LOOKUP_KEY
+#undef HT_LOOKUP_EQUAL
@@ -0,0 +1,577 @@
+/*
+	Benchmarks for DH_HashTable.
+
+	No build steps here either, it's one file:
+		g++ -O2 -std=c++17 -pthread DH_HashTable_benchmark.cpp -o ht_bench
+		clang++ -O2 -std=c++17 -pthread DH_HashTable_benchmark.cpp -o ht_bench
+	(-march=native if you want the AVX2 version of HT_SIMD_PROBE)
+
+	Everything is printed as CSV on stdout, there's nothing to download so it runs offline.
+
+	usage:
+		ht_bench suite [max_entries]   (the default)
+			the README charts and then some. inserts into an empty table, successful and unsuccessful lookups, removes and the
+			10x mix (1 insert, 1 remove, 10 lookups per round) for 1k, 64k and 1M entries (up to max_entries). Then churn (remove one,
+			insert one) and lookups at load factors .5 to .95 in a table that isn't allowed to grow. All of it for u32, u64,
+			short (< 16 bytes) and long (64+ bytes) string keys, against std::unordered_map with the same hash. The string keys are
+			also run through a HT_STRING_KEYS table (dh_hashtable_string_keys), which keeps its own copy of the keys.
+			columns: benchmark, key, table, entries, load_factor, ns_per_op
+		ht_bench concurrent [max_threads]
+			multi-threaded read/write throughput from 1 to max_threads (defaults to the number of cores) threads,
+			HT_CONCURRENT_SHARDS against the same table behind one global mutex. 90% lookups, 5% inserts, 5% removes.
+		ht_bench hash
+			ns per hash of the bundled hashfunctions (and fnv1a/a plain mixer to compare to), the probe lengths they give
+			for a few kinds of key sets and how long copying one table into another in iteration order takes with and without HT_SEED.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+
+static inline uint32_t bench_hash_u32(uint32_t x) {
+	x ^= x >> 16; x *= 0x7feb352d;
+	x ^= x >> 15; x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+// xorshift, each thread has its own
+static inline uint32_t bench_rand(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+	*state = x;
+	return (uint32_t)(x >> 32);
+}
+
+static double bench_seconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#define HT_NAME LockedMap
+#define HT_KEY uint32_t
+#define HT_VALUE uint32_t
+#define HT_HASH(key) bench_hash_u32(key)
+#include "DH_HashTable.h"
+
+#define HT_NAME IdentityMap
+#define HT_KEY uint32_t
+#define HT_VALUE uint32_t
+#define HT_HASH(key) (key)
+#include "DH_HashTable.h"
+
+#define HT_NAME MixedMap
+#define HT_KEY uint32_t
+#define HT_VALUE uint32_t
+#define HT_HASH(key) dh_ht_hash_u32(key)
+#include "DH_HashTable.h"
+
+#define HT_NAME SeededMap
+#define HT_KEY uint32_t
+#define HT_VALUE uint32_t
+#define HT_HASH(key) (key)
+#define HT_SEED
+#include "DH_HashTable.h"
+
+// the suite tables, Fixed ones are for the load factor sweep, they're made big enough up front and never grow
+#define HT_NAME U32Map
+#define HT_KEY uint32_t
+#define HT_VALUE uint32_t
+#define HT_HASH(key) dh_ht_hash_u32(key)
+#include "DH_HashTable.h"
+
+#define HT_NAME U32Fixed
+#define HT_KEY uint32_t
+#define HT_VALUE uint32_t
+#define HT_HASH(key) dh_ht_hash_u32(key)
+#define HT_GROW_FACTOR 0.96
+#include "DH_HashTable.h"
+
+#define HT_NAME U64Map
+#define HT_KEY uint64_t
+#define HT_VALUE uint32_t
+#define HT_HASH(key) dh_ht_hash_u64(key)
+#include "DH_HashTable.h"
+
+#define HT_NAME U64Fixed
+#define HT_KEY uint64_t
+#define HT_VALUE uint32_t
+#define HT_HASH(key) dh_ht_hash_u64(key)
+#define HT_GROW_FACTOR 0.96
+#include "DH_HashTable.h"
+
+#define HT_NAME StrMap
+#define HT_KEY const char *
+#define HT_VALUE uint32_t
+#define HT_HASH(key) dh_ht_hash_bytes(key, strlen(key), 0)
+#define HT_EQUAL(a, b) (strcmp(a, b) == 0)
+#include "DH_HashTable.h"
+
+#define HT_NAME StrFixed
+#define HT_KEY const char *
+#define HT_VALUE uint32_t
+#define HT_HASH(key) dh_ht_hash_bytes(key, strlen(key), 0)
+#define HT_EQUAL(a, b) (strcmp(a, b) == 0)
+#define HT_GROW_FACTOR 0.96
+#include "DH_HashTable.h"
+
+#define HT_NAME ArenaMap
+#define HT_VALUE uint32_t
+#define HT_STRING_KEYS
+#include "DH_HashTable.h"
+
+#define HT_NAME ArenaFixed
+#define HT_VALUE uint32_t
+#define HT_STRING_KEYS
+#define HT_GROW_FACTOR 0.96
+#include "DH_HashTable.h"
+
+#define HT_NAME ShardedMap
+#define HT_KEY uint32_t
+#define HT_VALUE uint32_t
+#define HT_HASH(key) bench_hash_u32(key)
+#define HT_CONCURRENT_SHARDS 64
+#include "DH_HashTable.h"
+
+// --- suite ----------------------------------------------------------------------------------------
+
+struct HashU32 { size_t operator()(uint32_t key) const { return dh_ht_hash_u32(key); } };
+struct HashU64 { size_t operator()(uint64_t key) const { return dh_ht_hash_u64(key); } };
+struct HashStr { size_t operator()(const char *key) const { return dh_ht_hash_bytes(key, strlen(key), 0); } };
+struct EqualStr { bool operator()(const char *a, const char *b) const { return strcmp(a, b) == 0; } };
+
+// std::unordered_map with the same interface as ours
+template <typename KEY, typename HASH, typename EQUAL = std::equal_to<KEY> >
+struct StdMap {
+	std::unordered_map<KEY, uint32_t, HASH, EQUAL> map;
+	StdMap() {}
+	StdMap(int capacity) { map.reserve(capacity); }
+	void insert(KEY key, uint32_t value) { map[key] = value; }
+	bool lookup(KEY key, uint32_t *value) {
+		typename std::unordered_map<KEY, uint32_t, HASH, EQUAL>::iterator it = map.find(key);
+		if (it == map.end()) return false;
+		*value = it->second;
+		return true;
+	}
+	bool remove(KEY key) { return map.erase(key) != 0; }
+	void destroy() { std::unordered_map<KEY, uint32_t, HASH, EQUAL>().swap(map); }
+};
+
+// HT_STRING_KEYS tables want a DH_HT_Str, the suite has const char *. The strlen is in there for StrMap as well (in its hash)
+template <typename MAP>
+struct ArenaStrMap {
+	MAP map;
+	ArenaStrMap() {}
+	ArenaStrMap(int capacity) : map(capacity) {}
+	void insert(const char *key, uint32_t value) { map.insert(dh_ht_str(key, (uint32_t)strlen(key)), value); }
+	bool lookup(const char *key, uint32_t *value) { return map.lookup(dh_ht_str(key, (uint32_t)strlen(key)), value); }
+	bool remove(const char *key) { return map.remove(dh_ht_str(key, (uint32_t)strlen(key))); }
+	void destroy() { map.destroy(); }
+};
+
+// 2n distinct keys, the first n are the ones that get inserted, the rest are for misses and churn.
+// string keys point into pool
+template <typename KEY>
+struct KeySet {
+	std::vector<KEY> keys;
+	std::vector<char> pool;
+	std::vector<uint32_t> order; // a shuffled 0..n-1 so lookups don't go in insertion order
+};
+
+static void shuffle_order(uint32_t n, std::vector<uint32_t> *order) {
+	uint64_t rng = 0x853C49E6748FEA9Bull;
+	order->resize(n);
+	for (uint32_t i = 0; i < n; i++) (*order)[i] = i;
+	for (uint32_t i = n; i > 1; i--) {
+		uint32_t j = bench_rand(&rng) % i;
+		uint32_t tmp = (*order)[i - 1]; (*order)[i - 1] = (*order)[j]; (*order)[j] = tmp;
+	}
+}
+
+// both hashes are bijections so the keys are distinct
+static void make_keys(uint32_t n, KeySet<uint32_t> *set) {
+	set->keys.resize(2 * (size_t)n);
+	for (uint32_t i = 0; i < 2 * n; i++) set->keys[i] = bench_hash_u32(i);
+	shuffle_order(n, &set->order);
+}
+
+static void make_keys(uint32_t n, KeySet<uint64_t> *set) {
+	set->keys.resize(2 * (size_t)n);
+	for (uint32_t i = 0; i < 2 * n; i++) set->keys[i] = dh_ht_hash_u64(i + 0x100000000ull);
+	shuffle_order(n, &set->order);
+}
+
+static void make_string_keys(uint32_t n, bool long_keys, KeySet<const char *> *set) {
+	// a shared prefix like paths or urls have, so the compares have to look at the whole thing
+	const char *prefix = long_keys ? "/usr/share/benchmarks/dh_hashtable/some/rather/deep/directory/" : "k";
+	std::vector<size_t> offsets(2 * (size_t)n);
+	set->pool.clear();
+	char key[128];
+	for (uint32_t i = 0; i < 2 * n; i++) {
+		int len = snprintf(key, sizeof(key), "%s%08x", prefix, bench_hash_u32(i));
+		offsets[i] = set->pool.size();
+		set->pool.insert(set->pool.end(), key, key + len + 1);
+	}
+	set->keys.resize(2 * (size_t)n);
+	for (uint32_t i = 0; i < 2 * n; i++) set->keys[i] = &set->pool[offsets[i]];
+	shuffle_order(n, &set->order);
+}
+
+static volatile uint64_t suite_sink;
+
+static void suite_row(const char *benchmark, const char *key_name, const char *table_name, uint64_t entries, double load_factor, double seconds, uint64_t ops) {
+	printf("%s, %s, %s, %llu, %.2f, %.2f\n", benchmark, key_name, table_name, (unsigned long long)entries, load_factor, seconds / ops * 1e9);
+	fflush(stdout);
+}
+
+// small tables are done over and over so every number is from at least a few million operations
+static uint32_t suite_rounds(uint32_t n) {
+	uint32_t rounds = (4u << 20) / n;
+	return rounds ? rounds : 1;
+}
+
+template <typename MAP, typename KEY>
+static void suite_basic(const char *key_name, const char *table_name, KeySet<KEY> &set, uint32_t n) {
+	const KEY *keys = set.keys.data();
+	const uint32_t *order = set.order.data();
+	uint32_t rounds = suite_rounds(n);
+	uint64_t sink = 0;
+	uint32_t value;
+
+	double insert_seconds = 0;
+	for (uint32_t r = 0; r < rounds; r++) {
+		MAP map;
+		double t0 = bench_seconds();
+		for (uint32_t i = 0; i < n; i++) map.insert(keys[i], i);
+		insert_seconds += bench_seconds() - t0;
+		map.destroy();
+	}
+	suite_row("insert", key_name, table_name, n, 0, insert_seconds, (uint64_t)rounds * n);
+
+	MAP map;
+	for (uint32_t i = 0; i < n; i++) map.insert(keys[i], i);
+
+	double t0 = bench_seconds();
+	for (uint32_t r = 0; r < rounds; r++) {
+		for (uint32_t i = 0; i < n; i++) sink += map.lookup(keys[order[i]], &value);
+	}
+	suite_row("lookup_hit", key_name, table_name, n, 0, bench_seconds() - t0, (uint64_t)rounds * n);
+
+	t0 = bench_seconds();
+	for (uint32_t r = 0; r < rounds; r++) {
+		for (uint32_t i = 0; i < n; i++) sink += map.lookup(keys[n + order[i]], &value);
+	}
+	suite_row("lookup_miss", key_name, table_name, n, 0, bench_seconds() - t0, (uint64_t)rounds * n);
+
+	// insert one new key, remove the oldest and look up 10 that are there. The size stays at n.
+	t0 = bench_seconds();
+	uint64_t mix_ops = 0;
+	for (uint32_t r = 0; r < rounds; r++) {
+		bool forward = (r & 1) == 0; // swap the two halves every round, so every round starts with the same number of keys
+		for (uint32_t i = 0; i < n; i++) {
+			uint32_t in = forward ? n + i : i, out = forward ? i : n + i;
+			map.insert(keys[in], i);
+			map.remove(keys[out]);
+			uint32_t base = forward ? n : 0;
+			for (uint32_t j = 0; j < 10; j++) sink += map.lookup(keys[base + order[(i * 10 + j) % n] % (i + 1)], &value);
+		}
+		mix_ops += 12 * (uint64_t)n;
+	}
+	suite_row("mix10x", key_name, table_name, n, 0, bench_seconds() - t0, mix_ops);
+
+	// whichever half is in there now
+	uint32_t base = (rounds & 1) ? n : 0;
+	t0 = bench_seconds();
+	for (uint32_t i = 0; i < n; i++) sink += map.remove(keys[base + order[i]]);
+	suite_row("remove", key_name, table_name, n, 0, bench_seconds() - t0, n);
+	map.destroy();
+	suite_sink = sink;
+}
+
+// a table that is as full as load_factor and stays that way, one remove and one insert per op
+template <typename MAP, typename KEY>
+static void suite_load_factors(const char *key_name, const char *table_name, KeySet<KEY> &set, uint32_t capacity) {
+	const KEY *keys = set.keys.data();
+	const uint32_t *order = set.order.data();
+	double load_factors[] = { 0.5, 0.6, 0.7, 0.8, 0.85, 0.9, 0.95 };
+	uint64_t sink = 0;
+	uint32_t value;
+	for (int l = 0; l < (int)(sizeof(load_factors) / sizeof(load_factors[0])); l++) {
+		uint32_t count = (uint32_t)(capacity * load_factors[l]);
+		MAP map((int)capacity);
+		for (uint32_t i = 0; i < count; i++) map.insert(keys[i], i);
+
+		double t0 = bench_seconds();
+		for (uint32_t i = 0; i < capacity; i++) sink += map.lookup(keys[order[i] % count], &value);
+		suite_row("lf_lookup_hit", key_name, table_name, count, load_factors[l], bench_seconds() - t0, capacity);
+
+		t0 = bench_seconds();
+		for (uint32_t i = 0; i < capacity; i++) sink += map.lookup(keys[capacity + order[i]], &value);
+		suite_row("lf_lookup_miss", key_name, table_name, count, load_factors[l], bench_seconds() - t0, capacity);
+
+		// slides a window of count keys along the 2 * capacity keys
+		uint32_t steps = 2 * capacity - count;
+		t0 = bench_seconds();
+		for (uint32_t i = 0; i < steps; i++) {
+			sink += map.remove(keys[i]);
+			map.insert(keys[count + i], i);
+		}
+		suite_row("lf_churn", key_name, table_name, count, load_factors[l], bench_seconds() - t0, steps);
+		map.destroy();
+	}
+	suite_sink = sink;
+}
+
+// MAP for the basic ones and FIXED (which doesn't grow before .96) for the load factors
+template <typename MAP, typename FIXED, typename KEY>
+static void suite_table(const char *key_name, const char *table_name, KeySet<KEY> &set, uint32_t max_entries, uint32_t sizes[3]) {
+	for (int s = 0; s < 3 && sizes[s] <= max_entries; s++) {
+		uint32_t n = sizes[s];
+		// the same keys for every size so the big set is only made once, only the first n (and n after that) are used
+		KeySet<KEY> sub;
+		sub.keys.assign(set.keys.begin(), set.keys.begin() + n);
+		sub.keys.insert(sub.keys.end(), set.keys.begin() + max_entries, set.keys.begin() + max_entries + n);
+		shuffle_order(n, &sub.order);
+		suite_basic<MAP>(key_name, table_name, sub, n);
+	}
+	uint32_t capacity = 1;
+	while (capacity * 2 <= max_entries) capacity *= 2;
+	KeySet<KEY> sub;
+	sub.keys.assign(set.keys.begin(), set.keys.begin() + capacity);
+	sub.keys.insert(sub.keys.end(), set.keys.begin() + max_entries, set.keys.begin() + max_entries + capacity);
+	shuffle_order(capacity, &sub.order);
+	suite_load_factors<FIXED>(key_name, table_name, sub, capacity);
+}
+
+template <typename MAP, typename FIXED, typename STD, typename KEY>
+static void suite_key(const char *key_name, KeySet<KEY> &set, uint32_t max_entries, uint32_t sizes[3]) {
+	suite_table<MAP, FIXED>(key_name, "dh_hashtable", set, max_entries, sizes);
+	suite_table<STD, STD>(key_name, "std_unordered_map", set, max_entries, sizes);
+}
+
+static void bench_suite(uint32_t max_entries) {
+	uint32_t sizes[3] = { 1 << 10, 1 << 16, 1 << 20 };
+	printf("benchmark, key, table, entries, load_factor, ns_per_op\n");
+	{
+		KeySet<uint32_t> set;
+		make_keys(max_entries, &set);
+		suite_key<U32Map, U32Fixed, StdMap<uint32_t, HashU32> >("u32", set, max_entries, sizes);
+	}
+	{
+		KeySet<uint64_t> set;
+		make_keys(max_entries, &set);
+		suite_key<U64Map, U64Fixed, StdMap<uint64_t, HashU64> >("u64", set, max_entries, sizes);
+	}
+	{
+		KeySet<const char *> set;
+		make_string_keys(max_entries, false, &set);
+		suite_key<StrMap, StrFixed, StdMap<const char *, HashStr, EqualStr> >("short_string", set, max_entries, sizes);
+		suite_table<ArenaStrMap<ArenaMap>, ArenaStrMap<ArenaFixed> >("short_string", "dh_hashtable_string_keys", set, max_entries, sizes);
+		make_string_keys(max_entries, true, &set);
+		suite_key<StrMap, StrFixed, StdMap<const char *, HashStr, EqualStr> >("long_string", set, max_entries, sizes);
+		suite_table<ArenaStrMap<ArenaMap>, ArenaStrMap<ArenaFixed> >("long_string", "dh_hashtable_string_keys", set, max_entries, sizes);
+	}
+}
+
+// --- concurrent -----------------------------------------------------------------------------------
+
+static const uint32_t CONCURRENT_KEYS = 1 << 20;
+static const uint64_t CONCURRENT_OPS_PER_THREAD = 2000000;
+
+struct GlobalLockMap {
+	std::mutex lock;
+	LockedMap map;
+	void insert(uint32_t key, uint32_t value) { std::lock_guard<std::mutex> guard(lock); map.insert(key, value); }
+	bool lookup(uint32_t key, uint32_t *value) { std::lock_guard<std::mutex> guard(lock); return map.lookup(key, value); }
+	bool remove(uint32_t key) { std::lock_guard<std::mutex> guard(lock); return map.remove(key); }
+};
+
+template <typename MAP>
+static void concurrent_worker(MAP *map, int thread_id, std::atomic<int> *start, uint64_t *found_out) {
+	uint64_t rng = 0x9E3779B97F4A7C15ull * (thread_id + 1);
+	uint64_t found = 0;
+	while (!start->load(std::memory_order_acquire));
+	for (uint64_t i = 0; i < CONCURRENT_OPS_PER_THREAD; i++) {
+		uint32_t r = bench_rand(&rng);
+		uint32_t key = r % (CONCURRENT_KEYS * 2);
+		uint32_t op = (r >> 24) % 100;
+		if (op < 90) {
+			uint32_t value;
+			found += map->lookup(key, &value);
+		} else if (op < 95) {
+			map->insert(key, (uint32_t)i);
+		} else {
+			map->remove(key);
+		}
+	}
+	*found_out = found;
+}
+
+template <typename MAP>
+static double concurrent_run(MAP *map, int num_threads) {
+	std::atomic<int> start(0);
+	std::vector<std::thread> threads;
+	std::vector<uint64_t> found(num_threads);
+	for (int i = 0; i < num_threads; i++) {
+		threads.push_back(std::thread(concurrent_worker<MAP>, map, i, &start, &found[i]));
+	}
+	double t0 = bench_seconds();
+	start.store(1, std::memory_order_release);
+	for (int i = 0; i < num_threads; i++) threads[i].join();
+	double elapsed = bench_seconds() - t0;
+	return (double)CONCURRENT_OPS_PER_THREAD * num_threads / elapsed / 1e6;
+}
+
+static void bench_concurrent(int max_threads) {
+	printf("threads, global_mutex_mops, sharded_mops\n");
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		GlobalLockMap *locked = new GlobalLockMap;
+		ShardedMap *sharded = new ShardedMap(CONCURRENT_KEYS * 2);
+		for (uint32_t key = 0; key < CONCURRENT_KEYS * 2; key += 2) {
+			locked->map.insert(key, key);
+			sharded->insert(key, key);
+		}
+		double locked_mops = concurrent_run(locked, threads);
+		double sharded_mops = concurrent_run(sharded, threads);
+		printf("%d, %.2f, %.2f\n", threads, locked_mops, sharded_mops);
+		locked->map.destroy();
+		sharded->destroy();
+		delete locked;
+		delete sharded;
+		if (threads < max_threads && threads * 2 > max_threads) threads = max_threads / 2;
+	}
+}
+
+// --- hash -----------------------------------------------------------------------------------------
+
+// keeps the compiler from throwing away the hashes
+static volatile uint64_t hash_sink;
+
+template <typename HASH>
+static void hash_cost(const char *name, HASH hash) {
+	const uint64_t n = 1 << 26;
+	uint64_t sum = 0;
+	double t0 = bench_seconds();
+	for (uint64_t i = 0; i < n; i++) sum += hash(i);
+	double elapsed = bench_seconds() - t0;
+	hash_sink = sum;
+	printf("%s, %.3f\n", name, elapsed / n * 1e9);
+}
+
+static void bytes_cost(size_t num_bytes) {
+	const size_t n = (64u << 20) / num_bytes + 1000;
+	char *data = (char *)malloc(num_bytes + 1024);
+	for (size_t i = 0; i < num_bytes + 1024; i++) data[i] = 'a' + i % 26;
+	uint64_t sum = 0;
+	double t0 = bench_seconds();
+	// the offset changes so it's not the same key every time
+	for (size_t i = 0; i < n; i++) sum += dh_ht_hash_bytes(data + (i & 1023), num_bytes, 0);
+	double wy = bench_seconds() - t0;
+	// fnv1a wants a terminated string
+	char *key = (char *)malloc(num_bytes + 1);
+	memcpy(key, data, num_bytes);
+	key[num_bytes] = 0;
+	t0 = bench_seconds();
+	for (size_t i = 0; i < n; i++) {
+		key[0] = 'a' + i % 26;
+		sum += dh_ht_fnv1a(key);
+	}
+	double fnv = bench_seconds() - t0;
+	hash_sink = sum;
+	printf("%zu, %.2f, %.2f\n", num_bytes, wy / n * 1e9, fnv / n * 1e9);
+	free(data);
+	free(key);
+}
+
+template <typename MAP>
+static void probe_lengths(const char *hash_name, const char *keys_name, uint32_t *keys, uint32_t n) {
+	MAP map;
+	for (uint32_t i = 0; i < n; i++) map.insert(keys[i], i);
+	uint64_t histogram[6] = {}; // 0, 1, 2-3, 4-7, 8-15, 16+
+	uint64_t total = 0, longest = 0;
+	for (uint64_t i = 0; i < map.capacity; i++) {
+		if (map.hash_at(i) == 0) continue;
+		uint64_t probe = map.probe_count(i);
+		total += probe;
+		if (probe > longest) longest = probe;
+		int b = probe == 0 ? 0 : probe == 1 ? 1 : probe < 4 ? 2 : probe < 8 ? 3 : probe < 16 ? 4 : 5;
+		++histogram[b];
+	}
+	printf("%s, %s, %.3f, %llu", hash_name, keys_name, (double)total / map.length, (unsigned long long)longest);
+	for (int b = 0; b < 6; b++) printf(", %.4f", (double)histogram[b] / map.length);
+	printf("\n");
+	map.destroy();
+}
+
+// copies a full table into a new one in iteration order, which is what makes unseeded tables quadratic
+template <typename MAP>
+static double reinsert_time(uint32_t n) {
+	MAP from;
+	for (uint32_t i = 0; i < n; i++) from.insert(bench_hash_u32(i), i);
+	double t0 = bench_seconds();
+	MAP to;
+	typename MAP::Iterator it = from.range(0, 1);
+	typename MAP::Bucket bucket;
+	while (it.next(&bucket)) to.insert(bucket.key, bucket.value);
+	double elapsed = bench_seconds() - t0;
+	from.destroy();
+	to.destroy();
+	return elapsed;
+}
+
+static void bench_hash() {
+	printf("hash, ns_per_hash\n");
+	hash_cost("bench_hash_u32", [](uint64_t i) { return (uint64_t)bench_hash_u32((uint32_t)i); });
+	hash_cost("dh_ht_hash_u32", [](uint64_t i) { return (uint64_t)dh_ht_hash_u32((uint32_t)i); });
+	hash_cost("dh_ht_hash_u64", [](uint64_t i) { return dh_ht_hash_u64(i); });
+
+	printf("\nkey_bytes, dh_ht_hash_bytes_ns, fnv1a_ns\n");
+	size_t sizes[] = { 4, 8, 16, 32, 64, 256, 4096 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) bytes_cost(sizes[i]);
+
+	const uint32_t n = 1 << 20;
+	uint32_t *keys = (uint32_t *)malloc(n * sizeof(uint32_t));
+	printf("\nhash, keys, avg_probe, max_probe, p0, p1, p2_3, p4_7, p8_15, p16_up\n");
+	const char *key_sets[] = { "sequential", "stride_4096", "random" };
+	for (int set = 0; set < 3; set++) {
+		uint64_t rng = 0x2545F4914F6CDD1Dull;
+		for (uint32_t i = 0; i < n; i++) {
+			keys[i] = set == 0 ? i : set == 1 ? i * 4096 : bench_rand(&rng);
+		}
+		probe_lengths<IdentityMap>("identity", key_sets[set], keys, n);
+		probe_lengths<MixedMap>("dh_ht_hash_u32", key_sets[set], keys, n);
+		probe_lengths<SeededMap>("identity+HT_SEED", key_sets[set], keys, n);
+	}
+	free(keys);
+
+	printf("\nentries, reinsert_unseeded_s, reinsert_seeded_s\n");
+	for (uint32_t entries = 1 << 14; entries <= 1 << 19; entries *= 2) {
+		printf("%u, %.4f, %.4f\n", entries, reinsert_time<MixedMap>(entries), reinsert_time<SeededMap>(entries));
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *what = argc > 1 ? argv[1] : "suite";
+	if (!strcmp(what, "suite")) {
+		uint32_t max_entries = argc > 2 ? (uint32_t)atoi(argv[2]) : 1 << 20;
+		if (max_entries < 1024) max_entries = 1024;
+		bench_suite(max_entries);
+	} else if (!strcmp(what, "concurrent")) {
+		int max_threads = argc > 2 ? atoi(argv[2]) : (int)std::thread::hardware_concurrency();
+		if (max_threads < 1) max_threads = 1;
+		bench_concurrent(max_threads);
+	} else if (!strcmp(what, "hash")) {
+		bench_hash();
+	} else {
+		printf("unknown benchmark '%s'\n", what);
+		return 1;
+	}
+	return 0;
+}
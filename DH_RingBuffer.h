@@ -15,8 +15,32 @@
 		TYPE
 		NUM_PRODUCERS
 		NUM_CONSUMERS
+	when NUM_PRODUCERS or NUM_CONSUMERS is 1 that side gets its own code: no cas, no trailing/active, it just moves
+	write/read with a release store and keeps its own copy of the other side's index, which it only reloads when the
+	buffer looks full/empty. SPSC is two plain stores and (mostly) no shared loads per element.
+
 	optinally also
 		NAME
+		BLOCKING
+			adds push_wait(id, elem, timeout_ns = -1) and pop_wait(id, &elem, timeout_ns = -1), which try BLOCKING_SPIN
+			(default 64) times and then sleep on a futex (WaitOnAddress on windows, a 100us poll anywhere else) until the
+			other side gets somewhere or the timeout runs out. push/pop only make a syscall if somebody is sleeping, but
+			they pay a full fence to check that.
+		GROWABLE
+			the buffer becomes a chain of segments that are allocated as needed, GROWABLE (a power of two) is the size of the
+			first/smallest one and MAX_NUM_ELEMENTS the size of the largest. A full segment is followed by one twice the size,
+			one that is mostly empty when it comes around again by one half the size, so memory follows the load instead of the
+			peak. There's no limit on the number of segments so push only fails if new fails. Inside a segment it works like
+			SLOT_SEQUENCE, lock-free, drained segments are freed once no thread is still looking at them (every thread
+			announces the segment it's in). A segment an idle thread looked at last stays around until it does something again.
+			Call destroy() when you're done with it. The NUM_PRODUCERS/NUM_CONSUMERS == 1 versions don't apply.
+		SLOT_SEQUENCE
+			every slot gets its own sequence number (Vyukov's bounded mpmc queue) instead of every thread publishing how far
+			it has got. push/pop then only touch their slot and read/write, where the default has to go over all the
+			consumers on every push and all the producers on every pop, so pick this when there are more than a handful
+			of threads. The ids are still taken but not used. push_n/pop_n still claim the batch with one compare_exchange,
+			but the elements are copied one by one since they sit between the sequence numbers. There's nothing special
+			for a single producer/consumer with this one.
 
 	//remember to zero initialize if not static
 	static DH_RingBuffer ringbuffer;
@@ -29,6 +53,13 @@
 		ringbuffer.pop(id, elem); 
 	to dequeue an item 
 
+	or in batches
+		ringbuffer.push_n(id, elems, n);
+		ringbuffer.pop_n(id, elems, max);
+	they return how many elements were moved (up to n/max, 0 if it was full/empty). A batch is claimed with a single
+	compare_exchange and copied with memcpy, so TYPE has to be trivially copyable for those. Elements pushed in one batch
+	come out in the same order, but with several consumers they might be split between them.
+
 	where id is your producer/consumer id
 	every thread that produces(push) needs to have a unique id {0 .. NUM_PRODUCERS-1}
 	every thread that consumes(pop)  needs to have a unique id {0 .. NUM_CONSUMERS-1}
@@ -69,6 +100,39 @@ static_assert(false, "need to define 'NUM_CONSUMERS', the number of consumer thr
 
 
 
+#ifdef GROWABLE
+static_assert(!(GROWABLE & (GROWABLE - 1)) && GROWABLE <= MAX_NUM_ELEMENTS, "'GROWABLE' must be a power of two and at most 'MAX_NUM_ELEMENTS'");
+#ifdef SLOT_SEQUENCE
+static_assert(false, "'GROWABLE' already has sequence numbers per slot, don't define 'SLOT_SEQUENCE' with it");
+#endif
+#endif
+
+#include <string.h>
+#include <stdint.h>
+#ifdef GROWABLE
+#include <new>
+#endif
+
+#ifdef BLOCKING
+#include <chrono>
+#include <thread>
+#include <limits.h>
+#if defined(_WIN32)
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifndef BLOCKING_SPIN
+#define BLOCKING_SPIN 64
+#endif
+#endif
+
 #ifdef _WIN32
 #define ALIGN_CACHE_LINE __declspec(align(64))
 #else
@@ -81,10 +145,409 @@ struct NAME
 struct DH_RingBuffer
 #endif
 {
+#if defined(GROWABLE)
+	// a chain of segments, each one a bounded queue like SLOT_SEQUENCE (see there for what the sequence numbers mean).
+	// producers push into tail, consumers pop from head. A producer that finds tail full closes it (sets CLOSED in
+	// its write index, after that nobody gets a slot in it) and links a segment twice the size. A segment that gets
+	// a new lap while it's at most a quarter full is closed the same way, with SHRINK, and is followed by one half the size.
+	// Once a closed segment is read up to where it was closed, consumers move head to the next one and retire it.
+	// Threads announce the segment they're working in (hazards), a retired segment is freed when nobody announces it.
+	struct Slot
+	{
+		std::atomic<uint64_t> sequence;
+		TYPE elem;
+	};
+
+	struct Segment
+	{
+		ALIGN_CACHE_LINE std::atomic<uint64_t> write;
+		ALIGN_CACHE_LINE std::atomic<uint64_t> read;
+		ALIGN_CACHE_LINE std::atomic<Segment *> next;
+		Segment *next_retired;
+		uint64_t capacity;
+		Slot slots[1]; // really capacity of them
+	};
+
+	static const uint64_t CLOSED = 1ull << 63;
+	static const uint64_t SHRINK = 1ull << 62;
+
+	ALIGN_CACHE_LINE std::atomic<Segment *> head;
+	ALIGN_CACHE_LINE std::atomic<Segment *> tail;
+	ALIGN_CACHE_LINE std::atomic<Segment *> retired;
+	// producer ids first, then the consumers
+	std::atomic<Segment *> hazards[NUM_PRODUCERS + NUM_CONSUMERS];
+
+	// pushes always succeed, unless there's no memory for a new segment
+	bool push(int producer_id, TYPE elem)
+	{
+		return push_n(producer_id, &elem, 1) == 1;
+	}
+
+	bool pop(int consumer_id, TYPE *elem)
+	{
+		return pop_n(consumer_id, elem, 1) == 1;
+	}
+
+	uint_fast32_t push_n(int producer_id, const TYPE *elems, uint_fast32_t n)
+	{
+		uint_fast32_t done = 0;
+		while (done < n)
+		{
+			Segment *seg = protect(tail, producer_id);
+			if (!seg)
+			{
+				if (!first_segment()) break;
+				continue;
+			}
+			uint64_t pos = seg->write.load(std::memory_order_relaxed);
+			if (!(pos & CLOSED))
+			{
+				if (shrink_wanted(seg, pos))
+				{
+					seg->write.compare_exchange_strong(pos, pos | CLOSED | SHRINK);
+					continue;
+				}
+				uint64_t count = claim(seg, seg->write, 0, n - done, &pos);
+				for (uint64_t i = 0; i < count; i++)
+				{
+					Slot *slot = &seg->slots[(pos + i) & (seg->capacity - 1)];
+					slot->elem = elems[done + i];
+					slot->sequence.store(lap(seg, pos + i) + 1, std::memory_order_release);
+				}
+				done += (uint_fast32_t)count;
+				if (count) continue;
+				// full
+				if (!(pos & CLOSED))
+				{
+					seg->write.compare_exchange_strong(pos, pos | CLOSED);
+					continue;
+				}
+			}
+			if (!link_next(seg)) break; // out of memory
+		}
+		if (done) wake_consumers();
+		return done;
+	}
+
+	uint_fast32_t pop_n(int consumer_id, TYPE *elems, uint_fast32_t max)
+	{
+		if (max == 0) return 0;
+		for (;;)
+		{
+			Segment *seg = protect(head, NUM_PRODUCERS + consumer_id);
+			if (!seg) return 0;
+			uint64_t pos;
+			uint64_t count = claim(seg, seg->read, 1, max, &pos);
+			if (count)
+			{
+				for (uint64_t i = 0; i < count; i++)
+				{
+					Slot *slot = &seg->slots[(pos + i) & (seg->capacity - 1)];
+					elems[i] = slot->elem;
+					slot->sequence.store(lap(seg, pos + i) + seg->capacity, std::memory_order_release);
+				}
+				wake_producers();
+				return (uint_fast32_t)count;
+			}
+			// nothing here, but if it's closed and read has caught up with where it was closed the rest is in the next one
+			uint64_t closed_at = seg->write.load(std::memory_order_acquire);
+			if (!(closed_at & CLOSED) || (closed_at & ~(CLOSED | SHRINK)) != seg->read.load(std::memory_order_acquire)) return 0;
+			Segment *next = seg->next.load(std::memory_order_acquire);
+			if (!next) return 0; // not linked yet, so nothing's been pushed after it either
+			if (head.compare_exchange_strong(seg, next)) retire(seg, next);
+		}
+	}
+
+	// frees all the segments, nobody may be using the buffer. It's empty (and zeroed) afterwards
+	void destroy()
+	{
+		Segment *seg = head.load();
+		while (seg)
+		{
+			Segment *next = seg->next.load();
+			delete_segment(seg);
+			seg = next;
+		}
+		seg = retired.load();
+		while (seg)
+		{
+			Segment *next = seg->next_retired;
+			delete_segment(seg);
+			seg = next;
+		}
+		head.store(0);
+		tail.store(0);
+		retired.store(0);
+		for (int i = 0; i < NUM_PRODUCERS + NUM_CONSUMERS; i++) hazards[i].store(0);
+	}
+
+	private:
+	uint64_t lap(Segment *seg, uint64_t pos)
+	{
+		return pos & ~(seg->capacity - 1);
+	}
+
+	// counts how many slots in a row from value are in state lap + ready (0 free, 1 written) and takes up to n of them
+	// with one cas. 0 if the first one isn't ready, or if value has CLOSED set (only write ever does)
+	uint64_t claim(Segment *seg, std::atomic<uint64_t> &value, uint64_t ready, uint64_t n, uint64_t *first)
+	{
+		if (n > seg->capacity) n = seg->capacity;
+		uint64_t pos = value.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			*first = pos;
+			if (pos & CLOSED) return 0;
+			uint64_t count = 0;
+			while (count < n && seg->slots[(pos + count) & (seg->capacity - 1)].sequence.load(std::memory_order_acquire)
+				== lap(seg, pos + count) + ready) ++count;
+			if (count == 0)
+			{
+				int64_t diff = (int64_t)(seg->slots[pos & (seg->capacity - 1)].sequence.load(std::memory_order_acquire) - (lap(seg, pos) + ready));
+				if (diff < 0) return 0; // full/empty
+				if (diff > 0) pos = value.load(std::memory_order_relaxed); // somebody got there first
+				continue;
+			}
+			if (value.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+			{
+				*first = pos;
+				return count;
+			}
+		}
+	}
+
+	// at the start of a lap with little in it, give the memory back
+	bool shrink_wanted(Segment *seg, uint64_t pos)
+	{
+		if (seg->capacity <= GROWABLE || pos == 0 || (pos & (seg->capacity - 1))) return false;
+		return pos - seg->read.load(std::memory_order_relaxed) <= seg->capacity / 4;
+	}
+
+	// announce the segment in root before touching it, and check it's still there afterwards (after that it can't be freed)
+	Segment *protect(std::atomic<Segment *> &root, int hazard)
+	{
+		Segment *seg = root.load(std::memory_order_acquire);
+		// still announced from last time, that's the common case
+		if (hazards[hazard].load(std::memory_order_relaxed) == seg) return seg;
+		for (;;)
+		{
+			hazards[hazard].store(seg, std::memory_order_seq_cst);
+			Segment *again = root.load(std::memory_order_seq_cst);
+			if (again == seg) return seg;
+			seg = again;
+		}
+	}
+
+	Segment *new_segment(uint64_t capacity)
+	{
+		size_t bytes = sizeof(Segment) + (capacity - 1) * sizeof(Slot);
+		Segment *seg = (Segment *)::operator new(bytes, std::align_val_t(64), std::nothrow);
+		if (seg)
+		{
+			memset((void *)seg, 0, bytes);
+			seg->capacity = capacity;
+		}
+		return seg;
+	}
+
+	static void delete_segment(Segment *seg)
+	{
+		::operator delete((void *)seg, std::align_val_t(64));
+	}
+
+	bool first_segment()
+	{
+		Segment *seg = new_segment(GROWABLE);
+		if (!seg) return false;
+		Segment *expected = 0;
+		// head is set before anything is pushed into it
+		if (tail.compare_exchange_strong(expected, seg)) head.store(seg, std::memory_order_release);
+		else delete_segment(seg);
+		return true;
+	}
+
+	// a closed segment gets its successor (whoever gets there first allocates it), and tail moves on to that
+	bool link_next(Segment *seg)
+	{
+		Segment *next = seg->next.load(std::memory_order_acquire);
+		if (!next)
+		{
+			uint64_t capacity = seg->capacity;
+			if (seg->write.load(std::memory_order_relaxed) & SHRINK) capacity /= 2;
+			else if (capacity < MAX_NUM_ELEMENTS) capacity *= 2;
+			next = new_segment(capacity);
+			if (!next) return false;
+			Segment *expected = 0;
+			if (!seg->next.compare_exchange_strong(expected, next))
+			{
+				delete_segment(next);
+				next = expected;
+			}
+		}
+		tail.compare_exchange_strong(seg, next);
+		return true;
+	}
+
+	// seg is off head, once it's off tail too nobody can get to it anymore other than through an announcement
+	void retire(Segment *seg, Segment *next)
+	{
+		Segment *expected = seg;
+		tail.compare_exchange_strong(expected, next);
+		seg->next_retired = retired.load(std::memory_order_relaxed);
+		while (!retired.compare_exchange_weak(seg->next_retired, seg));
+
+		// take the whole list so nobody else frees from it meanwhile, put back what's still announced
+		Segment *list = retired.exchange(0);
+		while (list)
+		{
+			Segment *candidate = list;
+			list = list->next_retired;
+			bool announced = false;
+			for (int i = 0; i < NUM_PRODUCERS + NUM_CONSUMERS; i++) announced |= hazards[i].load(std::memory_order_seq_cst) == candidate;
+			if (!announced)
+			{
+				delete_segment(candidate);
+				continue;
+			}
+			candidate->next_retired = retired.load(std::memory_order_relaxed);
+			while (!retired.compare_exchange_weak(candidate->next_retired, candidate));
+		}
+	}
+#elif defined(SLOT_SEQUENCE)
+	// the sequence of a slot says whose turn it is, stored relative to the lap so a zeroed buffer is ready to go:
+	//   lap(pos)     free, the producer that claims pos may write it
+	//   lap(pos) + 1 written, the consumer that claims pos may read it
+	// after the read it's lap(pos) + MAX_NUM_ELEMENTS, which is free for pos one lap later
+	struct Slot
+	{
+		std::atomic<uint_fast32_t> sequence;
+		TYPE elem;
+	};
+
+	Slot slots[MAX_NUM_ELEMENTS];
+	ALIGN_CACHE_LINE std::atomic<uint_fast32_t> read;
+	ALIGN_CACHE_LINE std::atomic<uint_fast32_t> write;
+
+	int mask(uint_fast32_t value)
+	{
+		return value & MAX_NUM_ELEMENTS - 1;
+	}
+
+	uint_fast32_t lap(uint_fast32_t pos)
+	{
+		return pos & ~(uint_fast32_t)(MAX_NUM_ELEMENTS - 1);
+	}
+
+	bool push(int producer_id, TYPE elem)
+	{
+		uint_fast32_t pos = write.load(std::memory_order_relaxed);
+		Slot *slot;
+		for (;;)
+		{
+			slot = &slots[mask(pos)];
+			// signed since a slow thread's pos can be a lap behind
+			int_fast32_t diff = (int_fast32_t)(slot->sequence.load(std::memory_order_acquire) - lap(pos));
+			if (diff == 0)
+			{
+				if (write.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			}
+			else if (diff < 0) return false; // last lap's element is still in there, full
+			else pos = write.load(std::memory_order_relaxed);
+		}
+		slot->elem = elem;
+		slot->sequence.store(lap(pos) + 1, std::memory_order_release);
+		wake_consumers();
+		return true;
+	}
+
+	bool pop(int consumer_id, TYPE *elem)
+	{
+		uint_fast32_t pos = read.load(std::memory_order_relaxed);
+		Slot *slot;
+		for (;;)
+		{
+			slot = &slots[mask(pos)];
+			int_fast32_t diff = (int_fast32_t)(slot->sequence.load(std::memory_order_acquire) - (lap(pos) + 1));
+			if (diff == 0)
+			{
+				if (read.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			}
+			else if (diff < 0) return false; // not written yet, empty
+			else pos = read.load(std::memory_order_relaxed);
+		}
+		*elem = slot->elem;
+		slot->sequence.store(lap(pos) + MAX_NUM_ELEMENTS, std::memory_order_release);
+		wake_producers();
+		return true;
+	}
+
+	uint_fast32_t push_n(int producer_id, const TYPE *elems, uint_fast32_t n)
+	{
+		uint_fast32_t pos, count = claim_run(write, 0, n, &pos);
+		for (uint_fast32_t i = 0; i < count; i++)
+		{
+			Slot *slot = &slots[mask(pos + i)];
+			slot->elem = elems[i];
+			slot->sequence.store(lap(pos + i) + 1, std::memory_order_release);
+		}
+		if (count) wake_consumers();
+		return count;
+	}
+
+	uint_fast32_t pop_n(int consumer_id, TYPE *elems, uint_fast32_t max)
+	{
+		uint_fast32_t pos, count = claim_run(read, 1, max, &pos);
+		for (uint_fast32_t i = 0; i < count; i++)
+		{
+			Slot *slot = &slots[mask(pos + i)];
+			elems[i] = slot->elem;
+			slot->sequence.store(lap(pos + i) + MAX_NUM_ELEMENTS, std::memory_order_release);
+		}
+		if (count) wake_producers();
+		return count;
+	}
+
+	private:
+	// counts how many slots in a row from value are in state lap + ready (0 free, 1 written) and takes them all with one cas.
+	// nobody else can claim them in between, and a slot that was ready stays ready until whoever claims it is done
+	inline uint_fast32_t claim_run
+		(std::atomic<uint_fast32_t> &value, uint_fast32_t ready, uint_fast32_t n, uint_fast32_t *first)
+	{
+		if (n > MAX_NUM_ELEMENTS) n = MAX_NUM_ELEMENTS;
+		uint_fast32_t pos = value.load(std::memory_order_relaxed);
+		*first = pos;
+		if (n == 0) return 0;
+		for (;;)
+		{
+			uint_fast32_t count = 0;
+			while (count < n && slots[mask(pos + count)].sequence.load(std::memory_order_acquire) == lap(pos + count) + ready) ++count;
+			if (count == 0)
+			{
+				int_fast32_t diff = (int_fast32_t)(slots[mask(pos)].sequence.load(std::memory_order_acquire) - (lap(pos) + ready));
+				if (diff < 0) return 0; // full/empty
+				if (diff > 0) pos = value.load(std::memory_order_relaxed); // somebody got there first
+				continue;
+			}
+			// on failure pos is reloaded and we count again
+			if (value.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+			{
+				*first = pos;
+				return count;
+			}
+		}
+	}
+#else
 
 	TYPE arr[MAX_NUM_ELEMENTS];
 	ALIGN_CACHE_LINE std::atomic<uint_fast32_t> read;
+#if NUM_CONSUMERS == 1
+	// only the consumer touches it, the last trailing write it saw
+	uint_fast32_t cached_write;
+#endif
 	ALIGN_CACHE_LINE std::atomic<uint_fast32_t> write;
+#if NUM_PRODUCERS == 1
+	// only the producer touches it, the last trailing read it saw
+	uint_fast32_t cached_read;
+#endif
 
 	struct ThreadData
 	{
@@ -110,6 +573,10 @@ struct DH_RingBuffer
 
 	uint_fast32_t get_trailing_read()
 	{
+#if NUM_CONSUMERS == 1
+		// a lone consumer only moves read once it's done with the element
+		return read.load(std::memory_order_acquire);
+#else
 		uint_fast32_t ret = read.load(std::memory_order_acquire);
 		for (int i = 0; i < NUM_CONSUMERS; i++)
 		{
@@ -121,11 +588,15 @@ struct DH_RingBuffer
 			}
 		}
 		return ret;
+#endif
 	}
 
 
 	uint_fast32_t get_trailing_write()
 	{
+#if NUM_PRODUCERS == 1
+		return write.load(std::memory_order_acquire);
+#else
 		uint_fast32_t ret = write.load(std::memory_order_acquire);
 		for (int i = 0; i < NUM_PRODUCERS; i++)
 		{
@@ -137,8 +608,41 @@ struct DH_RingBuffer
 			}
 		}
 		return ret;
+#endif
 	}
 
+#if NUM_PRODUCERS == 1
+	// a lone producer owns write: no cas, no trailing/active, the element is published by moving write past it.
+	// what the consumers have freed is only looked up again when the buffer seems full
+	bool push(int producer_id, TYPE elem)
+	{
+		uint_fast32_t w = write.load(std::memory_order_relaxed);
+		if (w - cached_read >= MAX_NUM_ELEMENTS)
+		{
+			cached_read = get_trailing_read();
+			if (w - cached_read >= MAX_NUM_ELEMENTS) return false;
+		}
+		arr[mask(w)] = elem;
+		write.store(w + 1, std::memory_order_release);
+		wake_consumers();
+		return true;
+	}
+
+	uint_fast32_t push_n(int producer_id, const TYPE *elems, uint_fast32_t n)
+	{
+		if (n > MAX_NUM_ELEMENTS) n = MAX_NUM_ELEMENTS;
+		uint_fast32_t w = write.load(std::memory_order_relaxed);
+		// w - cached_read can be more than MAX_NUM_ELEMENTS, trailing_read isn't monotonic with several consumers
+		if (w - cached_read > MAX_NUM_ELEMENTS - n) cached_read = get_trailing_read();
+		uint_fast32_t used = w - cached_read;
+		if (used >= MAX_NUM_ELEMENTS) return 0;
+		if (n > MAX_NUM_ELEMENTS - used) n = MAX_NUM_ELEMENTS - used;
+		copy_in(w, elems, n);
+		write.store(w + n, std::memory_order_release);
+		if (n) wake_consumers();
+		return n;
+	}
+#else
 	bool push(int producer_id, TYPE elem)
 	{
 		producers[producer_id].trailing.store(write.load(std::memory_order_acquire),std::memory_order_relaxed);
@@ -159,9 +663,69 @@ struct DH_RingBuffer
 		}
 
 		producers[producer_id].active.store(false, std::memory_order_release);
+		// even if we didn't push anything, while we were active our trailing may have held back a consumer that then went to sleep
+		wake_consumers();
 		return success;
 	}
 
+	uint_fast32_t push_n(int producer_id, const TYPE *elems, uint_fast32_t n)
+	{
+		if (n == 0) return 0;
+		producers[producer_id].trailing.store(write.load(std::memory_order_acquire),std::memory_order_relaxed);
+		producers[producer_id].active.store(true, std::memory_order_relaxed);
+		atomic_thread_fence(std::memory_order_release);
+		uint_fast32_t trailing_read = get_trailing_read();
+
+		// same as push but we take as many of the free slots as we need in one go
+		uint_fast32_t w;
+		uint_fast32_t count = atomic_post_add_up_to
+								(write, trailing_read + MAX_NUM_ELEMENTS, n, &w);
+
+		if (count)
+		{
+			copy_in(w, elems, count);
+			atomic_thread_fence(std::memory_order_release);
+		}
+
+		producers[producer_id].active.store(false, std::memory_order_release);
+		wake_consumers();
+		return count;
+	}
+
+#endif
+
+#if NUM_CONSUMERS == 1
+	// same thing for a lone consumer, it owns read and only looks at the producers again when the buffer seems empty.
+	// like pop below, cached_write - r - 1 >= MAX_NUM_ELEMENTS also catches a (stale) trailing write behind r
+	bool pop(int consumer_id, TYPE *elem)
+	{
+		uint_fast32_t r = read.load(std::memory_order_relaxed);
+		if (cached_write - r - 1 >= MAX_NUM_ELEMENTS)
+		{
+			cached_write = get_trailing_write();
+			if (cached_write - r - 1 >= MAX_NUM_ELEMENTS) return false;
+		}
+		*elem = arr[mask(r)];
+		read.store(r + 1, std::memory_order_release);
+		wake_producers();
+		return true;
+	}
+
+	uint_fast32_t pop_n(int consumer_id, TYPE *elems, uint_fast32_t max)
+	{
+		if (max == 0) return 0;
+		if (max > MAX_NUM_ELEMENTS) max = MAX_NUM_ELEMENTS;
+		uint_fast32_t r = read.load(std::memory_order_relaxed);
+		if (cached_write - r - 1 >= MAX_NUM_ELEMENTS || cached_write - r < max) cached_write = get_trailing_write();
+		uint_fast32_t available = cached_write - r;
+		if (available - 1 >= MAX_NUM_ELEMENTS) return 0;
+		if (max > available) max = available;
+		copy_out(r, elems, max);
+		read.store(r + max, std::memory_order_release);
+		wake_producers();
+		return max;
+	}
+#else
 	bool pop(int consumer_id, TYPE *elem)
 	{
 		consumers[consumer_id].trailing.store(read.load(std::memory_order_acquire),std::memory_order_relaxed);
@@ -182,10 +746,76 @@ struct DH_RingBuffer
 		}
 
 		consumers[consumer_id].active.store(false, std::memory_order_release);
+		wake_producers(); // see push
 		return success;
 	}
 
+	uint_fast32_t pop_n(int consumer_id, TYPE *elems, uint_fast32_t max)
+	{
+		if (max == 0) return 0;
+		consumers[consumer_id].trailing.store(read.load(std::memory_order_acquire),std::memory_order_relaxed);
+		consumers[consumer_id].active.store(true, std::memory_order_relaxed);
+		atomic_thread_fence(std::memory_order_release);
+		uint_fast32_t trailing_write = get_trailing_write();
+
+		// everything before trailing_write is written, take up to max of it
+		uint_fast32_t r;
+		uint_fast32_t count = atomic_post_add_up_to
+								(read, trailing_write, max, &r);
+
+		if (count)
+		{
+			atomic_thread_fence(std::memory_order_acquire);
+			copy_out(r, elems, count);
+		}
+
+		consumers[consumer_id].active.store(false, std::memory_order_release);
+		wake_producers();
+		return count;
+	}
+#endif
+
 	private:
+	// a batch goes in/out in at most two pieces, before and after the wrap
+	inline void copy_in(uint_fast32_t w, const TYPE *elems, uint_fast32_t count)
+	{
+		uint_fast32_t first = mask(w);
+		uint_fast32_t head = MAX_NUM_ELEMENTS - first < count ? MAX_NUM_ELEMENTS - first : count;
+		memcpy(arr + first, elems, head * sizeof(TYPE));
+		memcpy(arr, elems + head, (count - head) * sizeof(TYPE));
+	}
+
+	inline void copy_out(uint_fast32_t r, TYPE *elems, uint_fast32_t count)
+	{
+		uint_fast32_t first = mask(r);
+		uint_fast32_t head = MAX_NUM_ELEMENTS - first < count ? MAX_NUM_ELEMENTS - first : count;
+		memcpy(elems, arr + first, head * sizeof(TYPE));
+		memcpy(elems + head, arr, (count - head) * sizeof(TYPE));
+	}
+
+	// value may go up to (but not past) limit, claim up to n of that with one cas. returns how many we got, the first in *first.
+	// like the ones below this relies on the overflow: a stale limit behind value shows up as more than MAX_NUM_ELEMENTS free
+	inline uint_fast32_t atomic_post_add_up_to
+		(std::atomic<uint_fast32_t> &value, uint_fast32_t limit, uint_fast32_t n, uint_fast32_t *first)
+	{
+		for (;;)
+		{
+			uint_fast32_t curr = value.load(std::memory_order_acquire);
+			uint_fast32_t room = limit - curr;
+			if (room - 1 >= MAX_NUM_ELEMENTS)
+			{
+				*first = curr;
+				return 0;
+			}
+			uint_fast32_t count = room < n ? room : n;
+			if (value.compare_exchange_weak(curr, curr + count))
+			{
+				*first = curr;
+				return count;
+			}
+		}
+	}
+
 	inline uint_fast32_t atomic_post_increment_if_difference_less_than
 		(std::atomic<uint_fast32_t> &value, uint_fast32_t sub, uint_fast32_t comparend, bool *success)
 	{
@@ -223,6 +853,124 @@ struct DH_RingBuffer
 			}
 		}
 	}
+#endif
+
+	public:
+#ifdef BLOCKING
+	// push_wait/pop_wait spin a little and then sleep on one of these until the other side moves.
+	// epoch changes on every wake, so a wake between deciding to sleep and actually sleeping isn't lost
+	struct Parking
+	{
+		ALIGN_CACHE_LINE
+		std::atomic<uint32_t> epoch;
+		std::atomic<uint32_t> sleepers;
+	} not_empty, not_full;
+
+	// like push/pop but wait (up to timeout_ns, or forever if it's negative) until there's room/an element.
+	// returns false if the time ran out
+	bool push_wait(int producer_id, TYPE elem, int64_t timeout_ns = -1)
+	{
+		for (int i = 0; i < BLOCKING_SPIN; i++)
+		{
+			if (push(producer_id, elem)) return true;
+			cpu_relax();
+		}
+		return park_until([&]() { return push(producer_id, elem); }, not_full, timeout_ns);
+	}
+
+	bool pop_wait(int consumer_id, TYPE *elem, int64_t timeout_ns = -1)
+	{
+		for (int i = 0; i < BLOCKING_SPIN; i++)
+		{
+			if (pop(consumer_id, elem)) return true;
+			cpu_relax();
+		}
+		return park_until([&]() { return pop(consumer_id, elem); }, not_empty, timeout_ns);
+	}
+
+	private:
+	template <typename Try>
+	bool park_until(Try attempt, Parking &parking, int64_t timeout_ns)
+	{
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(timeout_ns);
+		for (;;)
+		{
+			uint32_t epoch = parking.epoch.load(std::memory_order_acquire);
+			parking.sleepers.fetch_add(1, std::memory_order_seq_cst);
+			// pairs with the fence in wake: either we see what they did or they see us in sleepers
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (attempt())
+			{
+				parking.sleepers.fetch_sub(1, std::memory_order_relaxed);
+				return true;
+			}
+			int64_t left = -1;
+			if (timeout_ns >= 0)
+			{
+				left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+				if (left < 0) left = 0;
+			}
+			if (left != 0) sleep_on(&parking.epoch, epoch, left);
+			parking.sleepers.fetch_sub(1, std::memory_order_relaxed);
+			if (attempt()) return true;
+			if (left == 0) return false;
+		}
+	}
+
+	inline void wake(Parking &parking)
+	{
+		// the element (or the free slot) is published by now, the fence keeps the sleepers load from moving above that
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (parking.sleepers.load(std::memory_order_relaxed) == 0) return;
+		parking.epoch.fetch_add(1, std::memory_order_release);
+		wake_all(&parking.epoch);
+	}
+
+	inline void wake_consumers() { wake(not_empty); }
+	inline void wake_producers() { wake(not_full); }
+
+	static inline void cpu_relax()
+	{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+		_mm_pause();
+#endif
+	}
+
+	// sleeps while *addr == expected, at most timeout_ns (negative is forever). may wake up for no reason
+	static inline void sleep_on(std::atomic<uint32_t> *addr, uint32_t expected, int64_t timeout_ns)
+	{
+#if defined(_WIN32)
+		DWORD ms = timeout_ns < 0 ? INFINITE : (DWORD)((timeout_ns + 999999) / 1000000);
+		WaitOnAddress((volatile VOID *)addr, &expected, sizeof(expected), ms);
+#elif defined(__linux__)
+		struct timespec ts, *timeout = 0;
+		if (timeout_ns >= 0)
+		{
+			ts.tv_sec = (time_t)(timeout_ns / 1000000000);
+			ts.tv_nsec = (long)(timeout_ns % 1000000000);
+			timeout = &ts;
+		}
+		syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, expected, timeout, 0, 0);
+#else
+		// no futex, poll instead
+		int64_t nap = timeout_ns < 0 || timeout_ns > 100000 ? 100000 : timeout_ns;
+		if (addr->load(std::memory_order_acquire) == expected) std::this_thread::sleep_for(std::chrono::nanoseconds(nap));
+#endif
+	}
+
+	static inline void wake_all(std::atomic<uint32_t> *addr)
+	{
+#if defined(_WIN32)
+		WakeByAddressAll((PVOID)addr);
+#elif defined(__linux__)
+		syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+#endif
+	}
+#else
+	private:
+	inline void wake_consumers() {}
+	inline void wake_producers() {}
+#endif
 };
 
 #ifdef MAX_NUM_ELEMENTS
@@ -233,8 +981,8 @@ struct DH_RingBuffer
 #undef TYPE
 #endif
 
-#ifdef NUM_CONSUMERS
-#undef NUM_CONSUMERS
+#ifdef NUM_PRODUCERS
+#undef NUM_PRODUCERS
 #endif
 
 #ifdef NUM_CONSUMERS
@@ -243,4 +991,20 @@ struct DH_RingBuffer
 
 #ifdef NAME
 #undef NAME 
-#endif
\ No newline at end of file
+#endif
+
+#ifdef SLOT_SEQUENCE
+#undef SLOT_SEQUENCE
+#endif
+
+#ifdef BLOCKING
+#undef BLOCKING
+#endif
+
+#ifdef BLOCKING_SPIN
+#undef BLOCKING_SPIN
+#endif
+
+#ifdef GROWABLE
+#undef GROWABLE
+#endif